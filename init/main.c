@@ -26,12 +26,20 @@ int main(int argc, char **argv, char **envp)
 	printf("Hello World!\n");
 	
 	cbn_handle_t vmo_handle = 0;
-	printf("Error %d\n", cbn_vmo_create(0x400000, &vmo_handle));
+	printf("Error %d\n", cbn_vmo_create(0x400000, &vmo_handle, 0));
 	printf("vmo handle %lx\n", vmo_handle);
 	void *r = NULL;
 	cbn_mmap(-1, vmo_handle, (void *) 0x7700000000, 0x400000, MAP_FLAG_FIXED, 0, MAP_PROT_WRITE, &r);
 	printf("Result: %p\n", r);
 	memset(r, 0xff, 0x400000);
 
+	/* Same thing, mapped with 2MiB pages */
+	cbn_handle_t huge_vmo = 0;
+	printf("Error %d\n", cbn_vmo_create(0x400000, &huge_vmo, VMO_CREATE_HUGE_PAGES));
+	void *huge = NULL;
+	cbn_mmap(-1, huge_vmo, (void *) 0x7800000000, 0x400000, MAP_FLAG_FIXED, 0, MAP_PROT_WRITE, &huge);
+	printf("Result: %p\n", huge);
+	memset(huge, 0xff, 0x400000);
+
 	return 0;
 }
\ No newline at end of file
@@ -613,7 +613,7 @@ AcpiOsCreateCache (
     UINT16                  MaxDepth,
     ACPI_CACHE_T        **ReturnCache)
 {
-	*ReturnCache = slab_create(CacheName, ObjectSize, MaxDepth, 0);
+	*ReturnCache = slab_create(CacheName, ObjectSize, 0, 0);
 	return AE_OK;
 }
 
@@ -363,6 +363,22 @@ void Lapic::SendSIPI(uint8_t id, IcrDeliveryMode mode, uint32_t page)
 	Write(LAPIC_ICR, (uint32_t) icr);
 }
 
+void Lapic::SendIpi(uint8_t id, IcrDeliveryMode mode, Interrupt::InterruptVector vector)
+{
+	Write(LAPIC_IPIID, (uint32_t) id << 24);
+	uint64_t icr = mode << 8 | (vector & 0xff);
+	icr |= (1 << 14);
+	Write(LAPIC_ICR, (uint32_t) icr);
+
+	while(Read(LAPIC_ICR) & LAPIC_ICR_DELIVERY_PENDING)
+		Cpu::Relax();
+}
+
+void SendIpi(unsigned int cpu, Interrupt::InterruptVector vector)
+{
+	get_per_cpu(cpu_lapic)->SendIpi(lapic_ids[cpu], IcrDeliveryMode::NORMAL, vector);
+}
+
 
 Gsi MapSourceGsiToDest(Gsi source_gsi)
 {
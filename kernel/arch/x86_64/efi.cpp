@@ -29,6 +29,7 @@
 
 #include <carbon/fpu.h>
 #include <carbon/x86/gdt.h>
+#include <carbon/x86/control_regs.h>
 
 struct boot_info *boot_info = NULL;
 
@@ -178,11 +179,10 @@ void *efi_get_phys_mem_reg(uintptr_t *base, uintptr_t *size, void *context)
 	if(curr_entry == nr_descs)
 		return NULL;
 
-	for(UINTN i = 0; i < curr_entry; i++, descriptors =
-		(EFI_MEMORY_DESCRIPTOR*) ((uintptr_t) descriptors + desc_size));
-	printf("Free region at %lu %016lx-%016lx\n", curr_entry, descriptors->PhysicalStart,
-				descriptors->PhysicalStart +
-				descriptors->NumberOfPages * PAGE_SIZE);
+	/* page_init walks the map several times, so go straight to the entry
+	 * and leave the logging to it */
+	descriptors = (EFI_MEMORY_DESCRIPTOR*) ((uintptr_t) gbl_descriptors +
+		curr_entry * desc_size);
 
 	*base = descriptors->PhysicalStart;
 	*size = descriptors->NumberOfPages * PAGE_SIZE;
@@ -275,6 +275,10 @@ extern "C" void efi_entry(struct boot_info *info)
 
 	x86_setup_physical_mappings();
 
+	/* Make read-only ptes apply to the kernel as well, so copies to user
+	 * memory fault on shared pages instead of writing through them */
+	x86::WriteCr0(x86::ReadCr0() | CR0_WP);
+
 	/* Fixup boot info */
 	boot_info = info = (struct boot_info *) phys_to_virt(info);
 	info->command_line = (wchar_t *) phys_to_virt(info->command_line);
@@ -59,7 +59,9 @@ void device_not_avail_excp(intctx_t *ctx)
 
 void __double_fault(intctx_t *ctx)
 {
-	__asm__ __volatile__("hlt");
+	/* Most likely a kernel stack overflow, running on the #DF stack */
+	printf("Double fault at %lx, rsp %lx\n", ctx->rip, ctx->rsp);
+	panic("Double fault");
 }
 
 void exception_panic(intctx_t *ctx)
@@ -8,6 +8,8 @@
 #include <stdint.h>
 
 #include <carbon/x86/idt.h>
+#include <carbon/x86/cpu.h>
+#include <carbon/x86/tss.h>
 #include <carbon/interrupt.h>
 
 idt_ptr_t idt_ptr;
@@ -33,6 +35,9 @@ void x86_init_exceptions(void)
 	x86_reserve_vector(6, isr6);
 	x86_reserve_vector(7, isr7);
 	x86_reserve_vector(8, isr8);
+	/* A kernel stack overflow faults on the guard page, and the #PF can't be
+	 * pushed on the same stack; take the resulting #DF on a stack of its own */
+	idt_set_ist(8, TSS_DOUBLE_FAULT_IST);
 	x86_reserve_vector(9, isr9);
 	x86_reserve_vector(10, isr10);
 	x86_reserve_vector(11, isr11);
@@ -59,6 +64,8 @@ void x86_init_exceptions(void)
 	Interrupt::ReserveInterrupts(0, 32);
 	//idt_set_system_gate(129,  (uint64_t) _sched_yield, 0x08, 0x8e);
 	//x86_reserve_vector(X86_MESSAGE_VECTOR, __cpu_handle_message);
+	x86_reserve_vector(X86_TLB_SHOOTDOWN_VECTOR, x86_tlb_shootdown_ipi);
+	Interrupt::ReserveInterrupts(X86_TLB_SHOOTDOWN_VECTOR, 1);
 	//x86_reserve_vector(255,  apic_spurious_irq);
 	idt_load();
 }
@@ -71,7 +78,7 @@ void idt_create_descriptor(uint8_t entry, uint64_t offset,
 	idt_entries[entry].offset_top = (offset >> 32);
 	idt_entries[entry].selector = selector;
 
-	idt_entries[entry].zero = 0;
+	idt_entries[entry].ist = 0;
 	idt_entries[entry].type_attr = flags;
 }
 
@@ -83,10 +90,15 @@ void idt_set_system_gate(uint8_t entry, uint64_t offset,
 	idt_entries[entry].offset_top = (offset >> 32);
 	idt_entries[entry].selector = selector;
 
-	idt_entries[entry].zero = 0;
+	idt_entries[entry].ist = 0;
 	idt_entries[entry].type_attr = flags | 0x60;
 }
 
+void idt_set_ist(uint8_t entry, uint8_t ist)
+{
+	idt_entries[entry].ist = ist;
+}
+
 void idt_load()
 {
 	idt_ptr.limit = sizeof(idt_entry_t) * 256 - 1;
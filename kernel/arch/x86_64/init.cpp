@@ -28,6 +28,7 @@
 #include <carbon/smp.h>
 
 #include <carbon/fpu.h>
+#include <carbon/tlb.h>
 #include <carbon/x86/gdt.h>
 #include <carbon/x86/syscall.h>
 
@@ -56,6 +57,8 @@ void x86_init(struct boot_info *info)
 
 	Fpu::Init();
 
+	tlb_init_cpu();
+
 	scheduler::initialize();
 
 	/* Invoke global constructors */
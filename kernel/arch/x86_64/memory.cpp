@@ -8,11 +8,15 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <limits.h>
 
 #include <carbon/memory.h>
 #include <carbon/page.h>
 #include <carbon/vm.h>
+#include <carbon/mmu_gather.h>
+#include <carbon/tlb.h>
 #include <carbon/x86/cpu.h>
+#include <carbon/x86/control_regs.h>
 
 #define PML_EXTRACT_ADDRESS(n) (n & 0x0FFFFFFFFFFFF000)
 
@@ -21,9 +25,15 @@ typedef struct
 	uint64_t entries[512];
 } PML;
 
+#define PML_KERNEL_HALF_START		256
+/* PS bit of PML3 and PML2 entries */
+#define PML_HUGE			(1 << 7)
+#define PML_WRITE			(1 << 1)
+#define PML_NX				(1UL << 63)
+
 static inline void __native_tlb_invalidate_page(void *addr)
 {
-	__asm__ __volatile__("invlpg %0"::"m"(addr));
+	__asm__ __volatile__("invlpg (%0)" :: "r"(addr) : "memory");
 }
 
 static inline void __native_tlb_invalidate_all()
@@ -31,6 +41,21 @@ static inline void __native_tlb_invalidate_all()
 	__asm__ __volatile__("mov %cr3, %rax; mov %rax, %cr3");
 }
 
+/* Reloading cr3 leaves global (i.e kernel) entries alone; toggling PGE
+ * doesn't */
+static inline void __native_tlb_invalidate_all_global()
+{
+	unsigned long cr4 = x86::ReadCr4();
+
+	if(cr4 & CR4_PGE)
+	{
+		x86::WriteCr4(cr4 & ~CR4_PGE);
+		x86::WriteCr4(cr4);
+	}
+	else
+		__native_tlb_invalidate_all();
+}
+
 static inline uint64_t make_pml4e(uint64_t base,
 				  uint64_t avl,
 				  uint64_t pcd,
@@ -162,7 +187,7 @@ void x86_setup_placement_mappings(void)
 
 	for(unsigned int i = paging_levels; i != 1; i--)
 	{
-		uint64_t entry = pml->entries[indices[i - 1]];
+		uint64_t entry = __atomic_load_n(&pml->entries[indices[i - 1]], __ATOMIC_RELAXED);
 		if(entry & 1)
 		{
 			void *page = (void*) PML_EXTRACT_ADDRESS(entry);
@@ -278,20 +303,151 @@ void x86_setup_physical_mappings()
 	}
 }
 
-void *__map_phys_to_virt(void *addr, uintptr_t virt, uintptr_t phys,
-	unsigned long prot)
+static inline unsigned int pml_index(uintptr_t virt, unsigned int level)
 {
-	PML *pml4 = (PML *) addr;
-	assert(pml4 != nullptr);
+	return (virt >> (12 + (level - 1) * 9)) & 0x1ff;
+}
 
-	const unsigned int paging_levels = 4;
-	unsigned int indices[paging_levels];
+/* Size of the memory an entry of a level's table maps */
+static inline unsigned long pml_entry_size(unsigned int level)
+{
+	return 1UL << (12 + (level - 1) * 9);
+}
+
+static inline bool pml_is_huge(uint64_t entry, unsigned int level)
+{
+	return (level == 3 || level == 2) && entry & PML_HUGE;
+}
+
+/* Fills table with the entries that map the same memory, with the same
+ * attributes, as the huge entry of a level's table */
+static void pml_split_huge(PML *table, uint64_t entry, unsigned int level)
+{
+	unsigned long child_size = pml_entry_size(level - 1);
+	uint64_t base = PML_EXTRACT_ADDRESS(entry) & ~(pml_entry_size(level) - 1);
+	uint64_t flags = entry & ~PML_EXTRACT_ADDRESS(entry);
+
+	/* Bit 7 is PAT, not PS, in a PML1 */
+	if(level - 1 == 1)
+		flags &= ~PML_HUGE;
+
+	for(unsigned int i = 0; i < 512; i++)
+		table->entries[i] = (base + i * child_size) | flags;
+}
+
+/* Tables that we allocated count their populated entries, so emptiness
+ * checks don't need to scan them. Boot-time tables don't. */
+static inline struct page *pml_page(PML *pml)
+{
+	struct page *p = phys_to_page((uintptr_t) pml - PHYS_BASE);
+
+	return p && p->flags & PAGE_FLAG_PAGE_TABLE ? p : nullptr;
+}
 
+static inline void pml_account(PML *pml, long delta)
+{
+	struct page *p = pml_page(pml);
+
+	if(p && delta)
+		__atomic_add_fetch(&p->pt_entries, delta, __ATOMIC_RELAXED);
+}
+
+static inline void pml_free_table(struct page *p)
+{
+	p->flags &= ~PAGE_FLAG_PAGE_TABLE;
+	free_page(p);
+}
+
+/* Returns the table the entry at index of a level's table points to,
+ * allocating it if it's missing and splitting the entry if it's huge */
+static PML *pml_next_level(PML *pml, unsigned int index, unsigned int level, bool is_user)
+{
+	uint64_t entry = __atomic_load_n(&pml->entries[index], __ATOMIC_RELAXED);
+
+	while(true)
+	{
+		if(entry & 1 && !pml_is_huge(entry, level))
+			return (PML *) phys_to_virt(PML_EXTRACT_ADDRESS(entry));
+
+		struct page *p = alloc_pages(1, 0);
+		if(!p)
+			return NULL;
+
+		void *page = p->paddr;
+		PML *table = (PML *) phys_to_virt(page);
+		uint64_t new_entry;
+
+		p->flags |= PAGE_FLAG_PAGE_TABLE;
+
+		if(entry & 1)
+		{
+			/* Same translation with a smaller page size, so no
+			 * flush is needed */
+			pml_split_huge(table, entry, level);
+			p->pt_entries = 512;
+			is_user = is_user || entry & (1 << 2);
+		}
+		else
+		{
+			memset(table, 0, PAGE_SIZE);
+			p->pt_entries = 0;
+		}
+
+		if(level == 4)
+		{
+			new_entry = make_pml4e((uint64_t) page, 0, 0, 0, is_user,
+				1, 1);
+		}
+		else
+		{
+			new_entry = make_pml3e((uint64_t) page, 0, 0, 0, 0, 0,
+				is_user, 1, 1);
+		}
+
+		/* Faults run with the address space shared, so another
+		 * cpu may have installed this table since we looked */
+		if(__atomic_compare_exchange_n(&pml->entries[index],
+			&entry, new_entry, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		{
+			if(!(entry & 1))
+				pml_account(pml, 1);
+			return table;
+		}
+
+		pml_free_table(p);
+	}
+}
+
+/* Walks down to the PML1 that covers virt, allocating any missing level */
+static PML *pml_walk_alloc(void *pml4, uintptr_t virt, bool is_user)
+{
+	PML *pml = (PML*)(phys_to_virt(pml4));
+
+	for(unsigned int level = 4; level != 1 && pml; level--)
+		pml = pml_next_level(pml, pml_index(virt, level), level, is_user);
+
+	return pml;
+}
+
+static inline uint64_t prot_to_pml1e(uintptr_t phys, unsigned long prot)
+{
 	bool is_write = prot & VM_PROT_WRITE;
 	bool is_user = prot & VM_PROT_USER;
 	bool is_global = !is_user;
 	bool is_nx = !(prot & VM_PROT_EXEC);
 
+	return make_pml1e(phys, is_nx, 0, is_global, 0, 0, is_user, is_write, 1);
+}
+
+void *__remap_phys_to_virt(void *addr, uintptr_t virt, uintptr_t phys,
+	unsigned long prot, bool *was_mapped)
+{
+	PML *pml4 = (PML *) addr;
+	assert(pml4 != nullptr);
+
+	bool is_write = prot & VM_PROT_WRITE;
+	bool is_nx = !(prot & VM_PROT_EXEC);
+
 	if(0 && !is_nx && is_write)
 	{
 		printf("map_phys_to_virt: Error: mapping of %lx"
@@ -299,47 +455,170 @@ void *__map_phys_to_virt(void *addr, uintptr_t virt, uintptr_t phys,
 		return nullptr;
 	}
 
-	for(unsigned int i = 0; i < paging_levels; i++)
-	{
-		indices[i] = (virt >> 12) >> (i * 9) & 0x1ff;
-	}
+	PML *pml = pml_walk_alloc(pml4, virt, prot & VM_PROT_USER);
+	if(!pml)
+		return NULL;
 
-	PML *pml = (PML*)(phys_to_virt(pml4));
-	
-	for(unsigned int i = paging_levels; i != 1; i--)
+	uint64_t old = __atomic_exchange_n(&pml->entries[(virt >> 12) & 0x1ff],
+					   prot_to_pml1e(phys, prot), __ATOMIC_RELEASE);
+	if(!(old & 1))
+		pml_account(pml, 1);
+
+	if(was_mapped)
+		*was_mapped = old & 1;
+
+	return (void*) virt;
+}
+
+void *__map_phys_to_virt(void *addr, uintptr_t virt, uintptr_t phys,
+	unsigned long prot)
+{
+	return __remap_phys_to_virt(addr, virt, phys, prot, nullptr);
+}
+
+static bool pml_can_map_huge(uint64_t entry, unsigned int level, uintptr_t virt,
+			     uintptr_t phys, size_t len)
+{
+	unsigned long size = pml_entry_size(level);
+
+	if(level == 3 && !x86::Cpu::HasCap(X86_FEATURE_PDPE1GB))
+		return false;
+
+	if(level != 3 && level != 2)
+		return false;
+
+	/* Don't throw away a table that's already there */
+	if(entry & 1 && !pml_is_huge(entry, level))
+		return false;
+
+	return len == size && !(virt & (size - 1)) && !(phys & (size - 1));
+}
+
+static int pml_map_range(PML *pml, unsigned int level, uintptr_t virt, uintptr_t phys,
+			 size_t size, unsigned long prot)
+{
+	unsigned long entry_size = pml_entry_size(level);
+	unsigned int index = pml_index(virt, level);
+	long added = 0;
+	int st = 0;
+
+	while(size)
 	{
-		uint64_t entry = pml->entries[indices[i - 1]];
-		if(entry & 1)
+		size_t len = entry_size - (virt & (entry_size - 1));
+		if(len > size)
+			len = size;
+
+		uint64_t entry = pml->entries[index];
+
+		if(level == 1 || pml_can_map_huge(entry, level, virt, phys, len))
 		{
-			void *page = (void*) PML_EXTRACT_ADDRESS(entry);
-			pml = (PML *) phys_to_virt(page);
+			uint64_t new_entry = prot_to_pml1e(phys, prot);
+
+			if(level != 1)
+				new_entry |= PML_HUGE;
+
+			pml->entries[index] = new_entry;
+			if(!(entry & 1))
+				added++;
 		}
 		else
 		{
-			struct page *p = alloc_pages(1, 0);
-			if(!p)
-				return NULL;
-			void *page = p->paddr;
-			memset(phys_to_virt(page), 0, PAGE_SIZE);
-			if(i == 3)
-			{
-				pml->entries[indices[i - 1]] =
-				make_pml4e((uint64_t) page, 0, 0, 0, is_user,
-					1, 1);
-			}
-			else
+			PML *next = pml_next_level(pml, index, level, prot & VM_PROT_USER);
+
+			if(!next || pml_map_range(next, level - 1, virt, phys, len, prot) < 0)
 			{
-				pml->entries[indices[i - 1]] =
-				make_pml3e((uint64_t) page, 0, 0, 0, 0, 0,
-					is_user, 1, 1);
+				st = -1;
+				break;
 			}
-			pml = (PML *) phys_to_virt(page);
 		}
+
+		virt += len;
+		phys += len;
+		size -= len;
+		index++;
 	}
 
-	pml->entries[indices[0]] = make_pml1e(phys, is_nx, 0,
-		is_global, 0, 0, is_user, is_write, 1);
-	return (void*) virt;
+	pml_account(pml, added);
+
+	return st;
+}
+
+/* Maps [virt, virt + size) to the physically contiguous [phys, phys + size)
+ * walking every table once, with 2MiB and 1GiB pages wherever both addresses
+ * are suitably aligned. Returns 0 on success, -1 if a table couldn't be
+ * allocated, in which case part of the range may have been mapped. */
+int __map_phys_range(void *addr, uintptr_t virt, uintptr_t phys, size_t size,
+	unsigned long prot)
+{
+	assert(!(virt & (PAGE_SIZE - 1)) && !(phys & (PAGE_SIZE - 1)));
+
+	return pml_map_range((PML *) phys_to_virt(addr), 4, virt, phys,
+			     size_to_pages(size) << PAGE_SHIFT, prot);
+}
+
+/* Maps pages[i] at virt + i * PAGE_SIZE for every non-NULL entry whose pte
+ * is still empty, with a single walk. The range can't cross a PML1.
+ * Returns the number of ptes that were filled in. */
+size_t __map_pages_batch(void *addr, uintptr_t virt, struct page **pages,
+	size_t nr, unsigned long prot)
+{
+	unsigned int index = (virt >> 12) & 0x1ff;
+
+	assert(index + nr <= 512);
+
+	PML *pml = pml_walk_alloc(addr, virt, prot & VM_PROT_USER);
+	if(!pml)
+		return 0;
+
+	size_t mapped = 0;
+
+	for(size_t i = 0; i < nr; i++)
+	{
+		if(!pages[i])
+			continue;
+
+		uint64_t expected = 0;
+		uint64_t entry = prot_to_pml1e((uintptr_t) pages[i]->paddr, prot);
+
+		/* Never clobber a pte that a racing fault already set up */
+		if(__atomic_compare_exchange_n(&pml->entries[index + i], &expected,
+			entry, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			mapped++;
+	}
+
+	pml_account(pml, mapped);
+
+	return mapped;
+}
+
+/* Returns the physical address virt is mapped to, or 0 if it isn't mapped */
+uintptr_t __virt_to_phys(void *addr, uintptr_t virt)
+{
+	PML *pml = (PML *) phys_to_virt(addr);
+
+	for(unsigned int i = 4; i != 0; i--)
+	{
+		unsigned int index = (virt >> (12 + (i - 1) * 9)) & 0x1ff;
+		uint64_t entry = pml->entries[index];
+
+		if(!(entry & 1))
+			return 0;
+
+		/* 1GiB and 2MiB pages */
+		if((i == 3 || i == 2) && entry & (1 << 7))
+		{
+			unsigned long page_size = 1UL << (12 + (i - 1) * 9);
+			return (PML_EXTRACT_ADDRESS(entry) & ~(page_size - 1)) +
+				(virt & (page_size - 1));
+		}
+
+		if(i == 1)
+			return PML_EXTRACT_ADDRESS(entry) + (virt & (PAGE_SIZE - 1));
+
+		pml = (PML *) phys_to_virt(PML_EXTRACT_ADDRESS(entry));
+	}
+
+	return 0;
 }
 
 void *map_phys_to_virt(uintptr_t virt, uintptr_t phys, unsigned long prot)
@@ -361,6 +640,11 @@ void flush_tlb(void *addr, size_t nr_pages)
 
 bool pml_is_empty(PML *pml)
 {
+	struct page *p = pml_page(pml);
+
+	if(p)
+		return __atomic_load_n(&p->pt_entries, __ATOMIC_RELAXED) == 0;
+
 	for(int i = 0; i < 512; i++)
 	{
 		if(pml->entries[i])
@@ -369,90 +653,274 @@ bool pml_is_empty(PML *pml)
 	return true;
 }
 
-void __unmap_page(PML *__pml4, void *addr)
-{ 
-	const unsigned int paging_levels = 4;
-	unsigned int indices[paging_levels];
-	unsigned long virt = (unsigned long) addr;
+/* Hands the pages a cleared leaf entry of a level's table mapped to the
+ * gather, to be freed after the flush */
+static void pml_gather_mapped_pages(struct mmu_gather *tlb, uint64_t entry, unsigned int level)
+{
+	unsigned long size = pml_entry_size(level);
+	uintptr_t phys = PML_EXTRACT_ADDRESS(entry) & ~(size - 1);
 
-	for(unsigned int i = 0; i < paging_levels; i++)
+	for(unsigned long off = 0; off < size; off += PAGE_SIZE)
 	{
-		indices[i] = (virt >> 12) >> (i * 9) & 0x1ff;
+		struct page *p = phys_to_page(phys + off);
+
+		if(p)
+			mmu_gather_free_page(tlb, p);
 	}
+}
 
-	unsigned long entry = 0;
+/* Clears the entries of a level's table that map [virt, virt + size),
+ * splitting huge pages that are only partly covered. Tables that end up
+ * empty are freed once the TLB has been flushed, since the cpu may still
+ * be caching them. */
+static int pml_unmap_range(struct mmu_gather *tlb, PML *pml, unsigned int level,
+			   uintptr_t virt, size_t size)
+{
+	unsigned long entry_size = pml_entry_size(level);
+	unsigned int index = pml_index(virt, level);
+	long removed = 0;
+	int st = 0;
 
-	PML *pml4 = (PML*) phys_to_virt(__pml4);
+	while(size)
+	{
+		size_t len = entry_size - (virt & (entry_size - 1));
+		if(len > size)
+			len = size;
 
-	entry = pml4->entries[indices[3]];
+		uint64_t entry = pml->entries[index];
 
-	if(!(entry & 1))
-		return;
+		if(!(entry & 1))
+		{
+			/* Nothing mapped */
+		}
+		else if(level == 1 || (pml_is_huge(entry, level) && len == entry_size))
+		{
+			pml->entries[index] = 0;
+			mmu_gather_add_range(tlb, virt, len);
+			removed++;
 
-	PML *pml3 = (PML*) phys_to_virt(PML_EXTRACT_ADDRESS(entry));
-	if(!pml3)
-		return;
-	
-	entry = pml3->entries[indices[2]];
+			if(tlb->free_mapped)
+				pml_gather_mapped_pages(tlb, entry, level);
+		}
+		else
+		{
+			PML *next = pml_next_level(pml, index, level, entry & (1 << 2));
 
-	if(!(entry & 1))
-		return;
+			if(!next || pml_unmap_range(tlb, next, level - 1, virt, len) < 0)
+			{
+				st = -1;
+				break;
+			}
 
-	PML *pml2 = (PML*) phys_to_virt(PML_EXTRACT_ADDRESS(entry));
-	if(!pml2)
-		return;
+			/* The kernel half's PML3s are shared by every address
+			 * space's PML4, so they can't ever go away */
+			bool shared = level == 4 && index >= PML_KERNEL_HALF_START;
 
-	entry = pml2->entries[indices[1]];
+			/* Only look at the table once we're done with it. Boot
+			 * time tables have a struct page too, but they never
+			 * came from the page allocator. */
+			struct page *p = pml_page(next);
 
-	if(!(entry & 1))
-		return;
+			if(!shared && p && pml_is_empty(next))
+			{
+				pml->entries[index] = 0;
+				removed++;
+				p->flags &= ~PAGE_FLAG_PAGE_TABLE;
+				mmu_gather_free_page(tlb, p);
+			}
+		}
 
-	PML *pml1 = (PML*) phys_to_virt(PML_EXTRACT_ADDRESS(entry));
-	if(!pml1)
-		return;
-	
-	pml1->entries[indices[0]] = 0;
+		virt += len;
+		size -= len;
+		index++;
+	}
 
-	/* Now that we've freed the destination page, work our way upwards to
-	 * check if the paging structures are empty.
-	 * If so, free them as well.
-	*/
+	pml_account(pml, -removed);
 
-	if(pml_is_empty(pml1))
-	{
-		uintptr_t raw_address = PML_EXTRACT_ADDRESS(pml2->entries[indices[1]]);
-		free_page(phys_to_page(raw_address));
-		pml2->entries[indices[1]] = 0;
-	}
+	return st;
+}
+
+/* Unmaps [addr, addr + len) of tlb's address space, leaving the flush (and
+ * the freeing of page tables) to the gather. Fails only if a huge page
+ * needed splitting and there was no memory for it. */
+int unmap_page_range_gather(struct mmu_gather *tlb, void *addr, size_t len)
+{
+	PML *pml4 = (PML *) phys_to_virt(tlb->as->arch_priv);
+
+	return pml_unmap_range(tlb, pml4, 4, (uintptr_t) addr,
+			       size_to_pages(len) << PAGE_SHIFT);
+}
+
+/* Write access is only ever taken away here: the entry may map a page that's
+ * shared with someone else, so making it writable is left to the next write
+ * fault, which knows whether a private copy is needed */
+static inline uint64_t pml_protect_entry(uint64_t entry, unsigned long prot)
+{
+	if(!(prot & VM_PROT_WRITE))
+		entry &= ~PML_WRITE;
 
-	if(pml_is_empty(pml2))
+	if(prot & VM_PROT_EXEC)
+		entry &= ~PML_NX;
+	else
+		entry |= PML_NX;
+
+	return entry;
+}
+
+/* Rewrites the write and execute permissions of the leaf entries that map
+ * [virt, virt + size), splitting huge pages that are only partly covered */
+static int pml_protect_range(struct mmu_gather *tlb, PML *pml, unsigned int level,
+			     uintptr_t virt, size_t size, unsigned long prot)
+{
+	unsigned long entry_size = pml_entry_size(level);
+	unsigned int index = pml_index(virt, level);
+
+	while(size)
 	{
-		uintptr_t raw_address = PML_EXTRACT_ADDRESS(pml3->entries[indices[2]]);
-		free_page(phys_to_page(raw_address));
-		pml3->entries[indices[2]] = 0;
+		size_t len = entry_size - (virt & (entry_size - 1));
+		if(len > size)
+			len = size;
+
+		uint64_t entry = pml->entries[index];
+
+		if(!(entry & 1))
+		{
+			/* Nothing mapped */
+		}
+		else if(level == 1 || (pml_is_huge(entry, level) && len == entry_size))
+		{
+			uint64_t new_entry;
+
+			/* The cpu may set the accessed and dirty bits under us */
+			while((new_entry = pml_protect_entry(entry, prot)) != entry)
+			{
+				if(__atomic_compare_exchange_n(&pml->entries[index], &entry,
+					new_entry, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+				{
+					mmu_gather_add_range(tlb, virt, len);
+					break;
+				}
+			}
+		}
+		else
+		{
+			PML *next = pml_next_level(pml, index, level, entry & (1 << 2));
+
+			if(!next || pml_protect_range(tlb, next, level - 1, virt, len, prot) < 0)
+				return -1;
+		}
+
+		virt += len;
+		size -= len;
+		index++;
 	}
 
-	if(pml_is_empty(pml3))
+	return 0;
+}
+
+/* Changes the permissions of whatever is mapped in [addr, addr + len) of
+ * tlb's address space, leaving the flush to the gather. Fails only if a
+ * huge page needed splitting and there was no memory for it. */
+int protect_page_range_gather(struct mmu_gather *tlb, void *addr, size_t len,
+			      unsigned long prot)
+{
+	PML *pml4 = (PML *) phys_to_virt(tlb->as->arch_priv);
+
+	return pml_protect_range(tlb, pml4, 4, (uintptr_t) addr,
+				 size_to_pages(len) << PAGE_SHIFT, prot);
+}
+
+int unmap_page_range(void *as, void *addr, size_t len)
+{
+	struct address_space *addr_space = as ? (struct address_space *) as :
+		Vm::get_current_address_space();
+	struct mmu_gather tlb;
+
+	mmu_gather_init(&tlb, addr_space);
+	int st = unmap_page_range_gather(&tlb, addr, len);
+	mmu_gather_flush(&tlb);
+
+	return st;
+}
+
+size_t tlb_full_flush_threshold = 32;
+
+void mmu_gather_init(struct mmu_gather *tlb, struct address_space *as)
+{
+	tlb->as = as;
+	tlb->start = ULONG_MAX;
+	tlb->end = 0;
+	tlb->nr_pages = 0;
+	tlb->free_mapped = false;
+	tlb->nr_free = 0;
+}
+
+void mmu_gather_add_page(struct mmu_gather *tlb, unsigned long addr)
+{
+	mmu_gather_add_range(tlb, addr, PAGE_SIZE);
+}
+
+void mmu_gather_add_range(struct mmu_gather *tlb, unsigned long addr, size_t len)
+{
+	if(addr < tlb->start)
+		tlb->start = addr;
+	if(addr + len > tlb->end)
+		tlb->end = addr + len;
+
+	tlb->nr_pages += len >> PAGE_SHIFT;
+}
+
+void mmu_gather_free_page(struct mmu_gather *tlb, struct page *page)
+{
+	if(tlb->nr_free == MMU_GATHER_MAX_PAGES)
+		mmu_gather_flush(tlb);
+
+	tlb->free[tlb->nr_free++] = page;
+}
+
+static bool address_space_is_loaded(struct address_space *as)
+{
+	/* The kernel half is shared by every address space */
+	if(as == &kernel_address_space)
+		return true;
+
+	return PML_EXTRACT_ADDRESS(x86::ReadCr3()) == (unsigned long) as->arch_priv;
+}
+
+void tlb_flush_local(struct address_space *as, unsigned long start, size_t nr_pages)
+{
+	if(nr_pages > tlb_full_flush_threshold)
 	{
-		uintptr_t raw_address = PML_EXTRACT_ADDRESS(pml4->entries[indices[3]]);
-		free_page(phys_to_page(raw_address));
-		pml4->entries[indices[3]] = 0;
+		if(as == &kernel_address_space)
+			__native_tlb_invalidate_all_global();
+		else
+			__native_tlb_invalidate_all();
 	}
+	else
+		flush_tlb((void *) start, nr_pages);
 }
 
-void unmap_page_range(void *as, void *addr, size_t len)
+void mmu_gather_flush(struct mmu_gather *tlb)
 {
-	size_t nr_pgs = size_to_pages(len);
-	unsigned long a = (unsigned long) addr;
-
-	while(nr_pgs--)
+	if(tlb->nr_pages)
 	{
-		/* TODO: Connect this up */
-		__unmap_page(NULL, (void *) a);
-		a += PAGE_SIZE;
+		size_t nr = (tlb->end - tlb->start) >> PAGE_SHIFT;
+
+		if(address_space_is_loaded(tlb->as))
+			tlb_flush_local(tlb->as, tlb->start, nr);
+
+		/* Pages freed through the gather of a user address space
+		 * are always page tables */
+		tlb_shootdown(tlb->as, tlb->start, nr, tlb->nr_free != 0);
 	}
 
-	flush_tlb(addr, size_to_pages(len));
+	for(size_t i = 0; i < tlb->nr_free; i++)
+		free_page(tlb->free[i]);
+
+	tlb->start = ULONG_MAX;
+	tlb->end = 0;
+	tlb->nr_pages = 0;
+	tlb->nr_free = 0;
 }
 
 extern char _text_start;
@@ -466,14 +934,8 @@ extern struct address_space kernel_address_space;
 
 void map_phys_to_virt_pgs(unsigned long start, unsigned long pstart, size_t size, unsigned long prot)
 {
-	size_t pages = size >> PAGE_SHIFT;
-
-	for(size_t i = 0; i < pages; i++)
-	{
-		map_phys_to_virt(start, pstart, prot);
-		start += PAGE_SIZE;
-		pstart += PAGE_SIZE;
-	}
+	assert(__map_phys_range(kernel_address_space.arch_priv, start, pstart,
+				size, prot) == 0);
 }
 
 void paging_protect_kernel(void)
@@ -511,7 +973,6 @@ void paging_protect_kernel(void)
 	__asm__ __volatile__("movq %0, %%cr3" :: "r"(pml));
 }
 
-#define PML_KERNEL_HALF_START		256
 void *vm_create_page_tables()
 {
 	struct page *pml4_page = alloc_pages(1, 0);
@@ -13,6 +13,8 @@
 #include <carbon/fpu.h>
 #include <carbon/x86/tss.h>
 #include <carbon/memory.h>
+#include <carbon/tlb.h>
+#include <carbon/kstack.h>
 #include <carbon/x86/vm.h>
 #include <carbon/x86/registers.h>
 #include <carbon/percpu.h>
@@ -29,8 +31,6 @@ PER_CPU_VAR_NOUNUSED(unsigned long scratch_rsp) = 0;
 namespace scheduler
 {
 
-constexpr size_t kernel_stack_size = 0x2000;
-
 bool arch_create_thread(struct thread *thread, thread_callback callback,
 		      void *context, create_thread_flags flags)
 {
@@ -60,15 +60,12 @@ bool arch_create_thread(struct thread *thread, thread_callback callback,
 
 bool arch_create_thread_low_level(struct thread *thread, struct registers *regs)
 {
-	unsigned long *kernel_stack = (unsigned long *) Vm::mmap(&kernel_address_space, 0,
-				kernel_stack_size, VM_PROT_WRITE);
+	unsigned long *kernel_stack = (unsigned long *) kstack_alloc();
 
 	if(!kernel_stack)
 		return false;
 
-	/* Reach the top of the stack */
-	thread->kernel_stack_top = kernel_stack =
-		(unsigned long *) ((unsigned char *) kernel_stack + kernel_stack_size);
+	thread->kernel_stack_top = kernel_stack;
 	
 	struct registers *stack_regs = ((struct registers *) kernel_stack) - 1;
 	memcpy(stack_regs, regs, sizeof(struct registers));
@@ -99,10 +96,12 @@ void arch_load_thread(struct thread *thread)
 	if(!(thread->flags & THREAD_FLAG_KERNEL))
 	{
 		Fpu::RestoreFpu(thread->fpu_area);
-		vm::switch_address_space(thread->owner->address_space.arch_priv);
+		tlb_switch_address_space(&thread->owner->address_space);
 		wrmsr(KERNEL_GS_BASE, thread->gs);
 		wrmsr(FS_BASE_MSR, thread->fs);
 	}
+	else
+		tlb_enter_lazy_mode();
 }
 
 };
@@ -27,10 +27,16 @@ cbn_status_t sys_cbn_write(cbn_handle_t handle, const void *buffer, size_t len,
 cbn_status_t sys_cbn_read(cbn_handle_t handle, void *buffer, size_t len, size_t *read);
 cbn_status_t sys_cbn_writev(cbn_handle_t handle, const struct iovec *iovs, int veccnt, size_t *res);
 cbn_status_t sys_cbn_readv(cbn_handle_t handle, const struct iovec *iovs, int veccnt, size_t *res);
-cbn_status_t sys_cbn_vmo_create(size_t size, cbn_handle_t *out);
+cbn_status_t sys_cbn_vmo_create(size_t size, cbn_handle_t *out, unsigned long flags);
+cbn_status_t sys_cbn_vmo_clone(cbn_handle_t vmo_handle, cbn_handle_t *out);
 cbn_status_t sys_cbn_mmap(cbn_handle_t process_handle, cbn_handle_t vmo_handle, void *hint,
 			    struct __cbn_mmap_packed_args *packed_args, long prot, void **result);
 cbn_status_t sys_cbn_unmap(cbn_handle_t process_handle, void *ptr, size_t length);
+cbn_status_t sys_cbn_vmo_read(cbn_handle_t vmo_handle, void *buf, size_t off, size_t len);
+cbn_status_t sys_cbn_vmo_write(cbn_handle_t vmo_handle, const void *buf, size_t off, size_t len);
+cbn_status_t sys_cbn_vmo_op(cbn_handle_t vmo_handle, unsigned long op, size_t off, size_t len);
+cbn_status_t sys_cbn_vmo_set_size(cbn_handle_t vmo_handle, size_t size);
+cbn_status_t sys_cbn_protect(cbn_handle_t process_handle, void *ptr, size_t length, long prot);
 
 namespace x86
 {
@@ -70,7 +76,14 @@ void *syscall_table_64[] =
 	(void *) sys_cbn_writev,
 	(void *) sys_cbn_duplicate_handle,
 	(void *) sys_cbn_vmo_create,
-	(void *) sys_cbn_mmap
+	(void *) sys_cbn_mmap,
+	(void *) sys_cbn_vmo_clone,
+	(void *) sys_cbn_vmo_read,
+	(void *) sys_cbn_vmo_write,
+	(void *) sys_cbn_vmo_op,
+	(void *) sys_cbn_vmo_set_size,
+	(void *) sys_cbn_unmap,
+	(void *) sys_cbn_protect
 };
 
 extern "C" long do_syscall64(struct syscall_frame *frame)
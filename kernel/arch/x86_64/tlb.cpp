@@ -0,0 +1,418 @@
+/*
+* Copyright (c) 2019 Pedro Falcato
+* This file is part of Carbon, and is released under the terms of the MIT License
+* check LICENSE at the root directory for more information
+*/
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <carbon/tlb.h>
+#include <carbon/vm.h>
+#include <carbon/memory.h>
+#include <carbon/percpu.h>
+#include <carbon/smp.h>
+#include <carbon/lock.h>
+#include <carbon/atomic.h>
+#include <carbon/address_space.h>
+
+#include <carbon/x86/apic.h>
+#include <carbon/x86/cpu.h>
+#include <carbon/x86/vm.h>
+#include <carbon/x86/eflags.h>
+#include <carbon/x86/control_regs.h>
+
+struct tlb_range
+{
+	struct address_space *as;
+	unsigned long start;
+	size_t nr_pages;
+};
+
+/* Ranges other cpus want this cpu to invalidate. Anything queued while an
+ * IPI is still pending is picked up by that same IPI. */
+struct tlb_shootdown_queue
+{
+	struct spinlock lock;
+	size_t nr_ranges;
+	bool flush_all;
+	/* Bumped by senders; the handler publishes the last one it saw in
+	 * done_gen once the flush is complete */
+	unsigned long queued_gen;
+	unsigned long done_gen;
+	struct tlb_range ranges[TLB_SHOOTDOWN_MAX_RANGES];
+};
+
+PER_CPU_VAR(struct tlb_shootdown_queue tlb_queue) = {};
+/* Address space whose user half is in cr3, nullptr for the kernel's */
+PER_CPU_VAR(struct address_space *tlb_loaded_as) = nullptr;
+/* Set while running a kernel thread on top of tlb_loaded_as */
+PER_CPU_VAR(unsigned long tlb_lazy) = 0;
+/* Set by senders that skipped this cpu because it was lazy */
+PER_CPU_VAR(unsigned long tlb_flush_pending) = 0;
+
+#define PCID_BITS		12
+#define PCID_GEN(ctx)		((ctx) >> PCID_BITS)
+
+/* PCID generation this cpu's TLB is clean for */
+PER_CPU_VAR(unsigned long pcid_cpu_gen) = 0;
+
+static bool pcid_enabled = false;
+static bool invpcid_supported = false;
+static struct spinlock pcid_lock = {};
+/* Next context to hand out; once the 4095 PCIDs (0 is the kernel's) run
+ * out, the generation goes up and every address space gets a new one */
+static unsigned long pcid_next = (1UL << PCID_BITS) | 1;
+
+static atomic<unsigned long> nr_ipis_sent{0};
+static atomic<unsigned long> nr_ipis_avoided{0};
+
+/* The queue and pcid locks can't go through spin_lock, which serves the
+ * queue itself while spinning. Callers have interrupts disabled. */
+static inline void tlb_lock(struct spinlock *lock)
+{
+	while(__sync_lock_test_and_set(&lock->lock, 1))
+		x86::Cpu::Relax();
+}
+
+static inline void tlb_unlock(struct spinlock *lock)
+{
+	__sync_lock_release(&lock->lock);
+}
+
+/* Cpus past TLB_MAX_CPUS have no bit: they're never left out of a
+ * shootdown, and always flush when switching address spaces */
+static inline unsigned long tlb_cpu_bit(unsigned int cpu)
+{
+	return cpu < TLB_MAX_CPUS ? 1UL << cpu : 0;
+}
+
+static inline bool tlb_cpu_in_mask(unsigned long mask, unsigned int cpu)
+{
+	return cpu >= TLB_MAX_CPUS || mask & tlb_cpu_bit(cpu);
+}
+
+/* Takes this cpu off as->stale_cpus once it has flushed its share of a
+ * shootdown. Anyone marking it stale while it runs as outside of lazy mode
+ * also finds it in active_cpus and sends it their range, so nothing is
+ * lost. Called with interrupts disabled. */
+static void tlb_unmark_stale(struct address_space *as)
+{
+	if(!pcid_enabled || as == &kernel_address_space || get_per_cpu(tlb_loaded_as) != as ||
+	   get_per_cpu(tlb_lazy))
+		return;
+
+	__atomic_and_fetch(&as->stale_cpus, ~tlb_cpu_bit(get_cpu_nr()), __ATOMIC_SEQ_CST);
+}
+
+/* Runs the flushes queued for this cpu. Called with interrupts disabled. */
+static void tlb_shootdown_handle_queue()
+{
+	struct tlb_shootdown_queue *q = get_per_cpu_ptr(tlb_queue);
+	struct tlb_range ranges[TLB_SHOOTDOWN_MAX_RANGES];
+
+	/* Senders set tlb_flush_pending before finding out whether we're
+	 * lazy. If we aren't, whoever set it since we last left lazy mode
+	 * has queued their range too, so it would only cost us a needless
+	 * full flush on the next switch. */
+	if(!get_per_cpu(tlb_lazy))
+		__atomic_store_n(get_per_cpu_ptr(tlb_flush_pending), 0, __ATOMIC_SEQ_CST);
+
+	tlb_lock(&q->lock);
+
+	if(q->queued_gen == q->done_gen)
+	{
+		tlb_unlock(&q->lock);
+		return;
+	}
+
+	size_t nr_ranges = q->nr_ranges;
+	bool flush_all = q->flush_all;
+	unsigned long gen = q->queued_gen;
+
+	memcpy(ranges, q->ranges, nr_ranges * sizeof(struct tlb_range));
+	q->nr_ranges = 0;
+	q->flush_all = false;
+
+	tlb_unlock(&q->lock);
+
+	struct address_space *loaded = get_per_cpu(tlb_loaded_as);
+	bool flushed_loaded = flush_all;
+
+	if(flush_all)
+		tlb_flush_local(&kernel_address_space, 0, SIZE_MAX);
+	else
+	{
+		for(size_t i = 0; i < nr_ranges; i++)
+		{
+			struct tlb_range *r = &ranges[i];
+
+			/* If we've switched away since, the cr3 reload took
+			 * care of it */
+			if(r->as != &kernel_address_space && r->as != loaded)
+				continue;
+
+			tlb_flush_local(r->as, r->start, r->nr_pages);
+			flushed_loaded = flushed_loaded || r->as == loaded;
+		}
+	}
+
+	if(flushed_loaded && loaded)
+		tlb_unmark_stale(loaded);
+
+	__atomic_store_n(&q->done_gen, gen, __ATOMIC_RELEASE);
+}
+
+void tlb_init_cpu()
+{
+	if(!x86::Cpu::HasCap(X86_FEATURE_PCID))
+		return;
+
+	/* Kernel mappings need to be global, or invlpg would only drop the
+	 * ones tagged with the current PCID */
+	x86::WriteCr4(x86::ReadCr4() | CR4_PGE | CR4_PCIDE);
+
+	pcid_enabled = true;
+	invpcid_supported = x86::Cpu::HasCap(X86_FEATURE_INVPCID);
+}
+
+/* Drops the entries of every PCID, global ones included */
+static void pcid_flush_all()
+{
+	if(invpcid_supported)
+	{
+		struct
+		{
+			unsigned long pcid;
+			unsigned long addr;
+		} desc = {0, 0};
+
+		__asm__ __volatile__("invpcid %0, %1" :: "m"(desc), "r"(2UL) : "memory");
+	}
+	else
+		tlb_flush_local(&kernel_address_space, 0, SIZE_MAX);
+}
+
+static unsigned long pcid_get(struct address_space *as)
+{
+	unsigned long ctx = __atomic_load_n(&as->pcid_ctx, __ATOMIC_ACQUIRE);
+
+	if(PCID_GEN(ctx) == PCID_GEN(__atomic_load_n(&pcid_next, __ATOMIC_ACQUIRE)))
+		return ctx;
+
+	tlb_lock(&pcid_lock);
+
+	ctx = as->pcid_ctx;
+
+	if(PCID_GEN(ctx) != PCID_GEN(pcid_next))
+	{
+		if(!(pcid_next & CR3_PCID_MASK))
+			pcid_next |= 1;
+
+		ctx = pcid_next;
+		__atomic_store_n(&pcid_next, pcid_next + 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&as->pcid_ctx, ctx, __ATOMIC_RELEASE);
+	}
+
+	tlb_unlock(&pcid_lock);
+
+	return ctx;
+}
+
+extern "C"
+void tlb_shootdown_handle_ipi()
+{
+	tlb_shootdown_handle_queue();
+}
+
+void tlb_poll_shootdowns()
+{
+	if(!Percpu::percpu_initialized() || !irq_is_disabled())
+		return;
+
+	struct tlb_shootdown_queue *q = get_per_cpu_ptr(tlb_queue);
+
+	if(__atomic_load_n(&q->queued_gen, __ATOMIC_RELAXED) == q->done_gen)
+		return;
+
+	tlb_shootdown_handle_queue();
+}
+
+/* Queues the range on cpu; returns true if an IPI needs to be sent */
+static bool tlb_queue_range(unsigned int cpu, struct address_space *as, unsigned long start,
+			    size_t nr_pages, unsigned long *gen)
+{
+	struct tlb_shootdown_queue *q = other_cpu_get_ptr(tlb_queue, cpu);
+
+	tlb_lock(&q->lock);
+
+	bool idle = q->nr_ranges == 0 && !q->flush_all;
+
+	if(q->nr_ranges == TLB_SHOOTDOWN_MAX_RANGES)
+		q->flush_all = true;
+	else
+		q->ranges[q->nr_ranges++] = {as, start, nr_pages};
+
+	*gen = ++q->queued_gen;
+
+	tlb_unlock(&q->lock);
+
+	return idle;
+}
+
+void tlb_shootdown(struct address_space *as, unsigned long start, size_t nr_pages,
+		   bool freed_tables)
+{
+	bool kernel = as == &kernel_address_space;
+
+	/* Cpus that switched away still have entries tagged with the PCID;
+	 * make them flush those when they come back. This is ordered
+	 * before reading active_cpus, like the lazy flag below. The cpus
+	 * that do get flushed now take themselves off again. */
+	if(pcid_enabled && !kernel)
+		__atomic_store_n(&as->stale_cpus, ~0UL, __ATOMIC_SEQ_CST);
+
+	if(!Percpu::percpu_initialized())
+		return;
+
+	unsigned long flags = irq_save_and_disable();
+
+	/* Our own TLB has been flushed by the caller, if as is loaded */
+	tlb_unmark_stale(as);
+
+	if(Smp::GetOnlineCpus() < 2)
+	{
+		irq_restore(flags);
+		return;
+	}
+
+	unsigned int self = get_cpu_nr();
+	unsigned int nr_cpus = Smp::GetNrCpus();
+	unsigned long mask = kernel ? ~0UL : __atomic_load_n(&as->active_cpus, __ATOMIC_SEQ_CST);
+
+	/* Cpus are done in batches of TLB_MAX_CPUS, so that the generations
+	 * we need to wait for fit on the stack */
+	for(unsigned int base = 0; base < nr_cpus; base += TLB_MAX_CPUS)
+	{
+		unsigned long targets = 0;
+		unsigned long gens[TLB_MAX_CPUS];
+		unsigned int end = nr_cpus - base < TLB_MAX_CPUS ? nr_cpus : base + TLB_MAX_CPUS;
+
+		for(unsigned int cpu = base; cpu < end; cpu++)
+		{
+			if(cpu == self || !tlb_cpu_in_mask(mask, cpu) || !Smp::IsOnline(cpu))
+				continue;
+
+			if(!kernel && !freed_tables)
+			{
+				/* Pairs with tlb_switch_address_space: either the cpu
+				 * sees the pending flush on its way out of lazy mode,
+				 * or we see that it has left it */
+				__atomic_store_n(other_cpu_get_ptr(tlb_flush_pending, cpu), 1,
+						 __ATOMIC_SEQ_CST);
+
+				if(__atomic_load_n(other_cpu_get_ptr(tlb_lazy, cpu), __ATOMIC_SEQ_CST))
+				{
+					nr_ipis_avoided.add_fetch(1, mem_order::relaxed);
+					continue;
+				}
+			}
+
+			if(tlb_queue_range(cpu, as, start, nr_pages, &gens[cpu - base]))
+			{
+				x86::Apic::SendIpi(cpu, X86_TLB_SHOOTDOWN_VECTOR);
+				nr_ipis_sent.add_fetch(1, mem_order::relaxed);
+			}
+			else
+				nr_ipis_avoided.add_fetch(1, mem_order::relaxed);
+
+			targets |= 1UL << (cpu - base);
+		}
+
+		for(unsigned int i = 0; targets; i++)
+		{
+			if(!(targets & (1UL << i)))
+				continue;
+
+			struct tlb_shootdown_queue *q = other_cpu_get_ptr(tlb_queue, base + i);
+
+			/* Keep serving our own queue, the target may well be waiting
+			 * on us with interrupts disabled */
+			while((long) (__atomic_load_n(&q->done_gen, __ATOMIC_ACQUIRE) - gens[i]) < 0)
+			{
+				tlb_shootdown_handle_queue();
+				x86::Cpu::Relax();
+			}
+
+			targets &= ~(1UL << i);
+		}
+	}
+
+	irq_restore(flags);
+}
+
+void tlb_switch_address_space(struct address_space *as)
+{
+	unsigned int cpu = get_cpu_nr();
+	struct address_space *prev = get_per_cpu(tlb_loaded_as);
+
+	__atomic_store_n(get_per_cpu_ptr(tlb_lazy), 0, __ATOMIC_SEQ_CST);
+
+	if(prev == as)
+	{
+		/* Catch up on the shootdowns we skipped while lazy */
+		if(__atomic_exchange_n(get_per_cpu_ptr(tlb_flush_pending), 0, __ATOMIC_SEQ_CST))
+			tlb_flush_local(as, 0, SIZE_MAX);
+		return;
+	}
+
+	if(prev)
+		__atomic_and_fetch(&prev->active_cpus, ~tlb_cpu_bit(cpu), __ATOMIC_SEQ_CST);
+	__atomic_or_fetch(&as->active_cpus, tlb_cpu_bit(cpu), __ATOMIC_SEQ_CST);
+
+	write_per_cpu(tlb_loaded_as, as);
+	__atomic_store_n(get_per_cpu_ptr(tlb_flush_pending), 0, __ATOMIC_SEQ_CST);
+
+	if(!pcid_enabled)
+	{
+		vm::switch_address_space(as->arch_priv);
+		return;
+	}
+
+	unsigned long ctx = pcid_get(as);
+	bool flush = true;
+
+	if(get_per_cpu(pcid_cpu_gen) != PCID_GEN(ctx))
+	{
+		/* PCIDs have been recycled since we last looked */
+		pcid_flush_all();
+		write_per_cpu(pcid_cpu_gen, PCID_GEN(ctx));
+		__atomic_and_fetch(&as->stale_cpus, ~tlb_cpu_bit(cpu), __ATOMIC_SEQ_CST);
+		flush = false;
+	}
+	else if(cpu < TLB_MAX_CPUS)
+	{
+		/* Pairs with tlb_shootdown, like tlb_lazy */
+		unsigned long old = __atomic_fetch_and(&as->stale_cpus, ~tlb_cpu_bit(cpu),
+						       __ATOMIC_SEQ_CST);
+		flush = old & tlb_cpu_bit(cpu);
+	}
+
+	unsigned long cr3 = (unsigned long) as->arch_priv | (ctx & CR3_PCID_MASK);
+
+	if(!flush)
+		cr3 |= CR3_NOFLUSH;
+
+	x86::WriteCr3(cr3);
+}
+
+void tlb_enter_lazy_mode()
+{
+	__atomic_store_n(get_per_cpu_ptr(tlb_lazy), 1, __ATOMIC_SEQ_CST);
+}
+
+void tlb_get_shootdown_stats(struct tlb_shootdown_stats *stats)
+{
+	stats->ipis_sent = nr_ipis_sent.load(mem_order::relaxed);
+	stats->ipis_avoided = nr_ipis_avoided.load(mem_order::relaxed);
+}
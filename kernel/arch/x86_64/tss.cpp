@@ -9,6 +9,7 @@
 #include <assert.h>
 
 #include <carbon/percpu.h>
+#include <carbon/kstack.h>
 
 #include <carbon/x86/tss.h>
 
@@ -34,7 +35,6 @@ void SetKernelStack(unsigned long stack)
 {
 	auto this_tss = get_per_cpu(tss);
 	this_tss->stack0 = stack;
-	this_tss->ist[0] = stack; 
 }
 
 extern "C" void tss_flush();
@@ -45,6 +45,12 @@ void InitPercpu(uint64_t *gdt)
 	assert(new_tss != nullptr);
 	memset(new_tss, 0, sizeof(tss_entry_t));
 
+	/* Use a proper kernel stack, so a double fault caused by a stack
+	 * overflow can't overrun the heap in turn */
+	void *df_stack = kstack_alloc();
+	assert(df_stack != nullptr);
+	new_tss->ist[TSS_DOUBLE_FAULT_IST - 1] = (uintptr_t) df_stack;
+
 	uint8_t *tss_gdtb = (uint8_t*) &gdt[7];
 	uint16_t *tss_gdtw = (uint16_t*) &gdt[7];
 	uint32_t *tss_gdtd = (uint32_t*) &gdt[7];
@@ -11,6 +11,20 @@
 #include <carbon/lock.h>
 #include <carbon/inode.h>
 #include <carbon/filesystem.h>
+#include <carbon/slab.h>
+
+static slab_cache dentry_cache{"dentry", sizeof(dentry), alignof(dentry), 0, nullptr};
+
+void *dentry::operator new(size_t size)
+{
+	(void) size;
+	return slab_allocate(&dentry_cache);
+}
+
+void dentry::operator delete(void *ptr)
+{
+	slab_free(&dentry_cache, ptr);
+}
 
 dentry* dentry::open(const char *name)
 {
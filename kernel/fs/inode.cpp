@@ -106,13 +106,12 @@ page_cache_block *inode::get_page_internal(size_t offset, long flags)
 	if(!create_vmobject_if_needed())
 		return nullptr;
 
-	auto b = i_pages->get(aligned_off);
+	/* Cached pages stay for as long as the inode does, so there's no need
+	 * for the vmo lock */
+	auto b = i_pages->lookup(aligned_off);
 
 	if(b)
-	{
-		i_pages->lock.Unlock();
 		return b->misc_data.cache_block;
-	}
 
 	/* Try to add it to the cache if it didn't exist before. */
 	auto new_block = do_caching(aligned_off, flags);
@@ -14,6 +14,20 @@
 #include <carbon/wait_queue.h>
 #include <carbon/lock.h>
 #include <carbon/list.h>
+#include <carbon/slab.h>
+
+static slab_cache page_cache_block_cache{"page_cache_block", sizeof(page_cache_block), alignof(page_cache_block), 0, nullptr};
+
+void *page_cache_block::operator new(size_t size)
+{
+	(void) size;
+	return slab_allocate(&page_cache_block_cache);
+}
+
+void page_cache_block::operator delete(void *ptr)
+{
+	slab_free(&page_cache_block_cache, ptr);
+}
 
 void page_cache_block::set_dirty()
 {
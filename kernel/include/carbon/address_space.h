@@ -9,14 +9,30 @@
 
 #include <carbon/lock.h>
 struct rb_tree;
+struct vm_region;
+
+/* Number of recently faulted regions remembered per address space */
+#define VM_REGION_CACHE_SIZE	4
 
 struct address_space
 {
 	unsigned long start;
 	unsigned long end;
 	struct rb_tree *area_tree;
-	Spinlock lock;
+	/* Taken shared by faults and vmo accesses through the address space,
+	 * exclusively by anything that changes the region tree */
+	rw_spinlock lock;
 	void *arch_priv;
+	/* Most recently found regions, MRU first. Updated racily under the
+	 * shared lock, cleared by vm_remove_region under the exclusive one */
+	struct vm_region *region_cache[VM_REGION_CACHE_SIZE];
+	/* Cpus that have this address space loaded, lazily or not; see
+	 * carbon/tlb.h */
+	unsigned long active_cpus;
+	/* PCID generation << 12 | PCID, 0 if it never got one */
+	unsigned long pcid_ctx;
+	/* Cpus that may still hold stale entries tagged with pcid_ctx */
+	unsigned long stale_cpus;
 };
 
 #endif
\ No newline at end of file
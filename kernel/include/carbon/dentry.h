@@ -28,6 +28,9 @@ public:
 	dentry(const char *name, inode* inode) : name(name),
 		underlying_inode(inode), children{}, lock{} {}
 
+	void *operator new(size_t size);
+	void operator delete(void *ptr);
+
 	dentry* lookup(const char *name);
 	void tear_down();
 
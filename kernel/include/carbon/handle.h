@@ -24,6 +24,10 @@ public:
 	/* Note: handle::handle() refers the kernel object on its own */
 	handle(refcountable *ko, unsigned long type, process *owner);
 	~handle();
+
+	void *operator new(size_t size);
+	void operator delete(void *ptr);
+
 	handle(const handle&) = delete;
 	handle(handle&& h)
 	{
@@ -22,4 +22,21 @@ extern "C"
 #endif
 struct heap *heap_get();
 
+#ifdef __cplusplus
+namespace Heap
+{
+
+struct heap_usage
+{
+	/* Bytes currently mapped for the heap */
+	size_t resident;
+	/* Bytes handed out by malloc and not yet freed */
+	size_t in_use;
+};
+
+void GetStats(struct heap_usage *usage);
+
+}
+#endif
+
 #endif
\ No newline at end of file
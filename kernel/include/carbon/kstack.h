@@ -0,0 +1,22 @@
+/*
+* Copyright (c) 2019 Pedro Falcato
+* This file is part of Carbon, and is released under the terms of the MIT License
+* check LICENSE at the root directory for more information
+*/
+#ifndef _CARBON_KSTACK_H
+#define _CARBON_KSTACK_H
+
+#include <stddef.h>
+
+#include <carbon/memory.h>
+
+#define KSTACK_SIZE			0x2000
+#define KSTACK_PAGES			(KSTACK_SIZE / PAGE_SIZE)
+/* Unmapped gap below every stack, so overflows fault instead of running
+ * into the next stack */
+#define KSTACK_GUARD_SIZE		PAGE_SIZE
+
+/* Returns the top of a mapped, KSTACK_SIZE kernel stack, or nullptr */
+void *kstack_alloc();
+
+#endif
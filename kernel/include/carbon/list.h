@@ -7,6 +7,8 @@
 #ifndef _CARBON_LIST_H
 #define _CARBON_LIST_H
 
+#include <carbon/slab.h>
+
 template <typename T>
 class LinkedList;
 
@@ -26,6 +28,19 @@ public:
 	{
 	}
 
+	static slab_cache node_cache;
+
+	void *operator new(size_t size)
+	{
+		(void) size;
+		return slab_allocate(&node_cache);
+	}
+
+	void operator delete(void *ptr)
+	{
+		slab_free(&node_cache, ptr);
+	}
+
 	inline void Append(LinkedListNode<T> *node)
 	{
 		next = node;
@@ -38,6 +53,10 @@ public:
 	}
 };
 
+template <typename T>
+slab_cache LinkedListNode<T>::node_cache{"LinkedListNode", sizeof(LinkedListNode<T>),
+					 alignof(LinkedListNode<T>), 0, nullptr};
+
 template <typename T>
 class LinkedListIterator
 {
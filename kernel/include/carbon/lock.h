@@ -84,6 +84,101 @@ public:
 using scoped_spinlock = scoped_lock<Spinlock>;
 using scoped_spinlock_irqsave = scoped_lock<Spinlock, true>;
 
+/* Reader/writer spinlock, for the paths that can't sleep on a rw_lock.
+ * A waiting writer stops new readers from getting in so it can't be starved.
+ * Like Spinlock, holding it in either mode disables preemption.
+*/
+class rw_spinlock
+{
+private:
+	unsigned long counter;
+	constexpr static unsigned long writer_held = 1UL << 63;
+	constexpr static unsigned long writer_waiting = 1UL << 62;
+public:
+	constexpr rw_spinlock() : counter(0) {}
+	~rw_spinlock();
+	void lock_read();
+	void unlock_read();
+	void lock_write();
+	void unlock_write();
+};
+
+class rw_lock;
+
+enum scoped_rwlock_type
+{
+	scoped_rwlock_read,
+	scoped_rwlock_write
+};
+
+template <scoped_rwlock_type type, typename LockType = rw_lock>
+class scoped_rwlock
+{
+private:
+	LockType *l;
+	bool is_locked;
+public:
+	void lock_read()
+	{
+		static_assert(type != scoped_rwlock_write, "can't use lock_read in a read scoped_rwlock");
+		l->lock_read();
+		is_locked = true;
+	}
+
+	void lock_write()
+	{
+		static_assert(type != scoped_rwlock_read, "can't use lock_write in a write scoped_rwlock");
+		l->lock_write();
+		is_locked = true;
+	}
+
+	void unlock_read()
+	{
+		static_assert(type != scoped_rwlock_write, "can't use unlock_read in a read scoped_rwlock");
+		l->unlock_read();
+		is_locked = false;
+	}
+
+	void unlock_write()
+	{
+		static_assert(type != scoped_rwlock_read, "can't use lock_write in a write scoped_rwlock");
+		l->unlock_write();
+		is_locked = false;
+	}
+
+	void lock()
+	{
+		if constexpr(type == scoped_rwlock_read)
+			lock_read();
+		else
+			lock_write();
+	}
+
+	void unlock()
+	{
+		if constexpr(type == scoped_rwlock_read)
+			unlock_read();
+		else
+			unlock_write();
+	}
+
+	constexpr scoped_rwlock(LockType *__l) : l(__l)
+	{
+		lock();
+	}
+
+	~scoped_rwlock()
+	{
+		if(is_locked)
+		{
+			unlock();
+		}
+	}
+};
+
+template <scoped_rwlock_type type>
+using scoped_rw_spinlock = scoped_rwlock<type, rw_spinlock>;
+
 #endif
 
 #endif
@@ -37,7 +37,12 @@ void *ksbrk(size_t size);
 void *__ksbrk(long inc);
 void __kbrk(void *break_);
 
-void unmap_page_range(void *as, void *addr, size_t len);
+struct mmu_gather;
+
+int unmap_page_range(void *as, void *addr, size_t len);
+int unmap_page_range_gather(struct mmu_gather *tlb, void *addr, size_t len);
+int protect_page_range_gather(struct mmu_gather *tlb, void *addr, size_t len,
+			      unsigned long prot);
 void flush_tlb(void *addr, size_t nr_pages);
 
 void malloc_reserve_memory_space(void);
@@ -0,0 +1,48 @@
+/*
+* Copyright (c) 2019 Pedro Falcato
+* This file is part of Carbon, and is released under the terms of the MIT License
+* check LICENSE at the root directory for more information
+*/
+#ifndef _CARBON_MMU_GATHER_H
+#define _CARBON_MMU_GATHER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+struct address_space;
+struct page;
+
+/* Pages (page tables or data) whose freeing is deferred until after the flush */
+#define MMU_GATHER_MAX_PAGES		32
+
+/* Collects the TLB invalidations of an unmap/protect operation so they can
+ * be done at once: page by page for small ranges, or as a full flush once
+ * more than tlb_full_flush_threshold pages are involved. Pages that the
+ * cpu may still reach through a stale TLB or paging-structure cache entry
+ * are only freed after that flush.
+*/
+struct mmu_gather
+{
+	struct address_space *as;
+	unsigned long start;
+	unsigned long end;
+	size_t nr_pages;
+	/* Also free the pages that the cleared ptes mapped */
+	bool free_mapped;
+	size_t nr_free;
+	struct page *free[MMU_GATHER_MAX_PAGES];
+};
+
+extern size_t tlb_full_flush_threshold;
+
+void mmu_gather_init(struct mmu_gather *tlb, struct address_space *as);
+/* Records that the pte for addr has been changed or cleared */
+void mmu_gather_add_page(struct mmu_gather *tlb, unsigned long addr);
+/* Same, for every pte (or huge entry) covering [addr, addr + len) */
+void mmu_gather_add_range(struct mmu_gather *tlb, unsigned long addr, size_t len);
+/* Frees page after the next flush */
+void mmu_gather_free_page(struct mmu_gather *tlb, struct page *page);
+/* Flushes everything gathered so far and frees the deferred pages */
+void mmu_gather_flush(struct mmu_gather *tlb);
+
+#endif
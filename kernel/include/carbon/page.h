@@ -10,8 +10,16 @@
 #include <stddef.h>
 
 #include <carbon/carbon.h>
+#include <carbon/memory.h>
 
 #define PAGE_FLAG_DONT_FREE		(1 << 0)
+/* Set on the first page of a free block that sits in a buddy free list */
+#define PAGE_FLAG_BUDDY			(1 << 1)
+/* The page holds a page table and keeps its pt_entries count */
+#define PAGE_FLAG_PAGE_TABLE		(1 << 2)
+
+/* Largest block the buddy allocator hands out is 2^PAGE_MAX_ORDER pages */
+#define PAGE_MAX_ORDER			10
 
 class page_cache_block;
 
@@ -21,14 +29,24 @@ struct page
 	struct page *next;
 	unsigned long ref;
 	unsigned long flags;
-	size_t off;		/* Offset in vmo */
+	union
+	{
+		size_t off;		/* Offset in vmo */
+		/* Populated entries, if the page holds a page table */
+		size_t pt_entries;
+	};
 
 	union
 	{
 		struct page *next_allocation;
 		struct page *next_virtual_region;
+		struct page *next_free;
 	} next_un;
 
+	/* Buddy allocator bookkeeping, only valid while PAGE_FLAG_BUDDY is set */
+	struct page *prev_free;
+	unsigned int order;
+
 	union
 	{
 		page_cache_block *cache_block;
@@ -60,11 +78,43 @@ void page_init(size_t memory_size, void *(*get_phys_mem_region)(uintptr_t *base,
 void *map_phys_to_virt(uintptr_t virt, uintptr_t phys, unsigned long prot);
 void *__map_phys_to_virt(void *priv, uintptr_t virt, uintptr_t phys,
 	unsigned long prot);
+/* Same, but reports whether a present pte got replaced, which other cpus
+ * may still have cached */
+void *__remap_phys_to_virt(void *priv, uintptr_t virt, uintptr_t phys,
+	unsigned long prot, bool *was_mapped);
+int __map_phys_range(void *priv, uintptr_t virt, uintptr_t phys, size_t size,
+	unsigned long prot);
+uintptr_t __virt_to_phys(void *priv, uintptr_t virt);
+size_t __map_pages_batch(void *priv, uintptr_t virt, struct page **pages,
+	size_t nr, unsigned long prot);
 
 void *map_pages(void *addr, unsigned long prot, unsigned int nr_pages);
 
-struct page *phys_to_page(uintptr_t p);
-struct page *page_add_page(void *p);
+/* Each section holds the struct pages of 2^PAGE_SECTION_SHIFT pages (128MiB) */
+#define PAGE_SECTION_SHIFT		15
+#define PAGES_PER_SECTION		(1UL << PAGE_SECTION_SHIFT)
+
+extern struct page **page_sections;
+extern unsigned long page_nr_sections;
+
+void page_sections_init(unsigned long max_pfn);
+void page_sections_populate(uintptr_t base, size_t size);
+
+static inline struct page *phys_to_page(uintptr_t phys)
+{
+	unsigned long pfn = phys >> PAGE_SHIFT;
+	unsigned long section = pfn >> PAGE_SECTION_SHIFT;
+
+	if(unlikely(section >= page_nr_sections || !page_sections[section]))
+		return NULL;
+
+	return page_sections[section] + (pfn & (PAGES_PER_SECTION - 1));
+}
+
+static inline unsigned long page_to_phys(struct page *p)
+{
+	return (unsigned long) p->paddr;
+}
 
 static inline unsigned long page_ref(struct page *p)
 {
@@ -83,9 +133,13 @@ struct page_usage
 {
 	size_t used_pages;
 	size_t total_pages;
+	size_t zero_pool_pages;
+	size_t zero_pool_hits;
+	size_t zero_pool_misses;
 };
 
 void GetStats(struct page_usage *u);
+bool ZeroPoolWork();
 
 }
 #endif
@@ -28,6 +28,9 @@ public:
 
 	~page_cache_block();
 
+	void *operator new(size_t size);
+	void operator delete(void *ptr);
+
 	/* set_dirty() - sets the page as dirty and allows it to get written to 
 	 * the backing storage.
 	*/
@@ -6,10 +6,17 @@
 #ifndef _CARBON_PERCPU_H
 #define _CARBON_PERCPU_H
 
+#include <stdbool.h>
+
 #include <carbon/compiler.h>
 
 unsigned int get_cpu_nr();
 
+#ifdef __cplusplus
+extern "C"
+#endif
+bool percpu_is_initialized(void);
+
 #define PER_CPU_VAR(var) __attribute__((section(".percpu"), used))	var
 #define PER_CPU_VAR_NOUNUSED(var) var __attribute__((section(".percpu")))
 
@@ -137,6 +144,7 @@ namespace Percpu
 {
 
 extern unsigned long *percpu_bases;
+extern unsigned long nr_bases;
 void Init();
 unsigned long InitForCpu(unsigned int cpu);
 bool percpu_initialized();
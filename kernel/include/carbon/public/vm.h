@@ -11,6 +11,30 @@
 
 #define MAP_FLAG_FILE	(1 << 0)
 #define MAP_FLAG_FIXED	(1 << 1)
+/* Only map the faulting page on a fault, never its resident neighbours */
+#define MAP_FLAG_NO_FAULT_AROUND	(1 << 2)
+/* Commit and map the whole range up front instead of on first touch */
+#define MAP_FLAG_POPULATE	(1 << 3)
+
+/* cbn_vmo_create flags */
+/* Back the vmo with 2MiB physically contiguous chunks; mappings of it that
+ * are 2MiB aligned, both in the address space and in the vmo, use huge
+ * pages. The size is rounded up to 2MiB. */
+#define VMO_CREATE_HUGE_PAGES	(1 << 0)
+
+/* cbn_vmo_clone makes a copy-on-write child of the vmo, with the semantics
+ * of a MAP_PRIVATE file mapping rather than those of a snapshot: writes to
+ * the clone stay in the clone, but offsets it hasn't written keep reading
+ * the parent's current contents, later writes to the parent included. */
+
+/* cbn_vmo_op operations */
+/* Commit [off, off + len), which needs to be page aligned */
+#define VMO_OP_COMMIT		0
+/* Free the pages in the page aligned [off, off + len), unmapping them from
+ * every mapping of the vmo; they read as zeroes again afterwards */
+#define VMO_OP_DECOMMIT		1
+/* Make [off, off + len) read as zeroes */
+#define VMO_OP_ZERO		2
 
 #define MAP_PROT_READ	(1 << 0)
 #define MAP_PROT_WRITE	(1 << 1)
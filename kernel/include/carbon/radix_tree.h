@@ -0,0 +1,67 @@
+/*
+* Copyright (c) 2019 Pedro Falcato
+* This file is part of Carbon, and is released under the terms of the MIT License
+* check LICENSE at the root directory for more information
+*/
+#ifndef _CARBON_RADIX_TREE_H
+#define _CARBON_RADIX_TREE_H
+
+#include <stddef.h>
+
+#define RADIX_TREE_MAP_SHIFT		6
+#define RADIX_TREE_MAP_SIZE		(1UL << RADIX_TREE_MAP_SHIFT)
+#define RADIX_TREE_MAP_MASK		(RADIX_TREE_MAP_SIZE - 1)
+
+struct radix_tree_node
+{
+	/* How far the index is shifted to get this node's slot; 0 for the
+	 * nodes that hold the items themselves */
+	unsigned int shift;
+	unsigned int count;
+	void *slots[RADIX_TREE_MAP_SIZE];
+};
+
+/* Sparse array of pointers, indexed by an unsigned long, that grows in height
+ * as bigger indices get inserted. Writers need to serialise with a lock of
+ * their own; lookups can run without it, since interior nodes are only ever
+ * freed by radix_tree_destroy(). Whatever keeps the items alive is up to
+ * the user.
+*/
+struct radix_tree
+{
+	struct radix_tree_node *root;
+	size_t nr_items;
+};
+
+/* Returns the item at index, or nullptr. Safe without the writer lock. */
+void *radix_tree_lookup(struct radix_tree *tree, unsigned long index);
+
+/* Fills items[] with the nr items at consecutive indices starting at first,
+ * nullptr where there's none. Returns the number of items found. */
+size_t radix_tree_gang_lookup(struct radix_tree *tree, unsigned long first, size_t nr,
+			      void **items);
+
+/* Returns the first item at or after *index, which is updated to its index,
+ * or nullptr if there's none */
+void *radix_tree_next(struct radix_tree *tree, unsigned long *index);
+
+/* Returns 0, -EEXIST if index is in use or -ENOMEM */
+int radix_tree_insert(struct radix_tree *tree, unsigned long index, void *item);
+
+/* Stores items at consecutive indices starting at first, stopping at the
+ * first index that's in use. Returns how many were stored, or -EEXIST or
+ * -ENOMEM if not even items[0] could be. */
+long radix_tree_insert_range(struct radix_tree *tree, unsigned long first, void **items,
+			     size_t nr);
+
+/* Removes and returns the item at index, or nullptr if there was none */
+void *radix_tree_delete(struct radix_tree *tree, unsigned long index);
+
+/* Frees every node, calling func (if not null) on every item left */
+void radix_tree_destroy(struct radix_tree *tree, void (*func)(void *item));
+
+#define radix_tree_for_each(tree, index, item)					\
+	for((index) = 0; ((item) = (decltype(item)) radix_tree_next((tree), &(index))) != nullptr;	\
+	    (index)++)
+
+#endif
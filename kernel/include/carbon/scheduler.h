@@ -49,6 +49,9 @@ struct thread
 #endif
 
 	struct registers *get_registers();
+
+	void *operator new(size_t size);
+	void operator delete(void *ptr);
 };
 
 #define THREAD_FLAG_KERNEL		(1 << 0)
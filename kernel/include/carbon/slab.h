@@ -0,0 +1,98 @@
+/*
+* Copyright (c) 2019 Pedro Falcato
+* This file is part of Carbon, and is released under the terms of the MIT License
+* check LICENSE at the root directory for more information
+*/
+#ifndef _CARBON_SLAB_H
+#define _CARBON_SLAB_H
+
+#include <stddef.h>
+
+#include <carbon/compiler.h>
+#include <carbon/lock.h>
+#include <carbon/page.h>
+
+#define SLAB_MAGAZINE_SIZE		15
+/* Magazines are aligned to the cache line, so cpus don't false-share them */
+#define SLAB_MAGAZINE_ALIGN		64
+/* Every slab holds at least this many objects, if the size allows it */
+#define SLAB_MIN_OBJECTS		8
+/* Space reserved for struct slab at the start of each slab */
+#define SLAB_HEADER_SIZE		64
+
+struct slab;
+
+/* Per-cpu stack of free objects, which lets the common alloc/free pair
+ * run without touching the cache lock.
+*/
+struct slab_magazine
+{
+	unsigned long nr_objs;
+	void *objs[SLAB_MAGAZINE_SIZE];
+} align(SLAB_MAGAZINE_ALIGN);
+
+struct slab_cache
+{
+	const char *name;
+	size_t object_size;
+	size_t alignment;
+	unsigned int flags;
+	void (*ctor)(void *);
+
+	/* Geometry, worked out at construction time */
+	size_t slot_size;
+	size_t free_off;
+	size_t first_obj_off;
+	size_t slab_pages;
+	size_t objs_per_slab;
+
+	struct slab *partial;
+	struct slab *full;
+	struct slab *empty;
+	Spinlock lock;
+	/* One magazine per cpu, allocated on first use once the number of
+	 * cpus is known */
+	struct slab_magazine *magazines;
+	unsigned int nr_magazines;
+
+	static constexpr size_t align_up(size_t x, size_t align)
+	{
+		return (x + align - 1) & -align;
+	}
+
+	constexpr slab_cache(const char *name, size_t size, size_t alignment,
+		unsigned int flags, void (*ctor)(void *)) : name(name), object_size(size),
+		alignment(alignment < sizeof(void *) ? sizeof(void *) : alignment),
+		flags(flags), ctor(ctor), slot_size(0), free_off(0), first_obj_off(0),
+		slab_pages(1), objs_per_slab(0), partial(nullptr), full(nullptr),
+		empty(nullptr), lock{}, magazines(nullptr), nr_magazines(0)
+	{
+		/* Objects that have a constructor keep their constructed state
+		 * while free, so the freelist link can't live inside them */
+		if(ctor)
+		{
+			free_off = align_up(size, sizeof(void *));
+			slot_size = align_up(free_off + sizeof(void *), this->alignment);
+		}
+		else
+			slot_size = align_up(size < sizeof(void *) ? sizeof(void *) : size,
+					     this->alignment);
+
+		/* The slab header is kept at the start of the slab */
+		first_obj_off = align_up(SLAB_HEADER_SIZE, this->alignment);
+
+		while(slab_pages < (1UL << PAGE_MAX_ORDER) &&
+		      (slab_pages * PAGE_SIZE - first_obj_off) / slot_size < SLAB_MIN_OBJECTS)
+			slab_pages <<= 1;
+
+		objs_per_slab = (slab_pages * PAGE_SIZE - first_obj_off) / slot_size;
+	}
+};
+
+struct slab_cache *slab_create(const char *name, size_t size, size_t alignment,
+	unsigned int flags, void (*ctor)(void *) = nullptr);
+void slab_destroy(struct slab_cache *cache);
+void *slab_allocate(struct slab_cache *cache);
+void slab_free(struct slab_cache *cache, void *addr);
+
+#endif
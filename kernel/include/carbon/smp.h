@@ -18,6 +18,8 @@ void SetNumberOfCpus(unsigned int nr);
 void SetOnline(unsigned int cpu);
 void Boot(unsigned int cpu);
 unsigned int GetOnlineCpus();
+unsigned int GetNrCpus();
+bool IsOnline(unsigned int cpu);
 
 void BootCpus();
 
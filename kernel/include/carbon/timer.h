@@ -7,6 +7,8 @@
 #ifndef _CARBON_TIMER_H
 #define _CARBON_TIMER_H
 
+#include <stddef.h>
+
 #include <carbon/clocksource.h>
 
 namespace Timer
@@ -30,6 +32,9 @@ public:
 
 	~TimerEvent(){}
 
+	void *operator new(size_t size);
+	void operator delete(void *ptr);
+
 	inline bool DecrementTicks()
 	{
 		/* If we have to trigger in that moment,
@@ -0,0 +1,58 @@
+/*
+* Copyright (c) 2019 Pedro Falcato
+* This file is part of Carbon, and is released under the terms of the MIT License
+* check LICENSE at the root directory for more information
+*/
+#ifndef _CARBON_TLB_H
+#define _CARBON_TLB_H
+
+#include <stddef.h>
+
+struct address_space;
+
+/* Ranges a cpu can have queued before its next shootdown degrades into a
+ * full flush */
+#define TLB_SHOOTDOWN_MAX_RANGES	8
+/* Width of address_space::active_cpus and stale_cpus. Cpus past it aren't
+ * tracked, and get every shootdown and a full flush on every switch. */
+#define TLB_MAX_CPUS			(sizeof(unsigned long) * 8)
+
+struct tlb_shootdown_stats
+{
+	unsigned long ipis_sent;
+	/* Cpus that didn't get interrupted, either because they were in lazy
+	 * mode or because an IPI already in flight picked up the range */
+	unsigned long ipis_avoided;
+};
+
+/* Enables process-context identifiers on this cpu if it supports them,
+ * which lets address space switches keep the previous TLB entries around */
+void tlb_init_cpu();
+
+/* Invalidates [start, start + nr_pages * PAGE_SIZE) of as on this cpu */
+void tlb_flush_local(struct address_space *as, unsigned long start, size_t nr_pages);
+
+/* Invalidates the range on every other cpu that may have it cached, and
+ * waits for them to be done; the caller flushes its own cpu beforehand.
+ * Lazy cpus are skipped unless page tables were freed, as they could still
+ * walk them speculatively.
+ * Callers may hold spinlocks: targets spinning on them with interrupts
+ * disabled run their queued flushes through tlb_poll_shootdowns() */
+void tlb_shootdown(struct address_space *as, unsigned long start, size_t nr_pages,
+		   bool freed_tables);
+
+/* Runs the flushes other cpus queued for this one, if interrupts are
+ * disabled and the IPI can't get through. Called by lock waiters while
+ * spinning. */
+void tlb_poll_shootdowns();
+
+/* Loads as on this cpu, leaving lazy mode */
+void tlb_switch_address_space(struct address_space *as);
+
+/* Called when this cpu starts running a kernel thread: the previous address
+ * space stays loaded, but shootdowns to it are deferred until it's used again */
+void tlb_enter_lazy_mode();
+
+void tlb_get_shootdown_stats(struct tlb_shootdown_stats *stats);
+
+#endif
@@ -27,9 +27,20 @@ extern struct address_space kernel_address_space;
 #define VM_PROT_EXEC		(1 << 1)
 #define VM_PROT_USER		(1 << 2)
 
+/* vm_region::flags */
+#define VM_REGION_NO_FAULT_AROUND	(1 << 0)
+
+/* Upper bound for the fault-around window, in pages */
+#define VM_FAULT_AROUND_MAX_PAGES	64
+
+/* Chunks huge-page vmos commit in, which is what a PML2 entry maps */
+#define VM_HUGE_PAGE_SIZE		(1UL << 21)
+#define VM_HUGE_PAGE_PAGES		(VM_HUGE_PAGE_SIZE / PAGE_SIZE)
+
 int vm_cmp(const void* k1, const void* k2);
 
 class vm_object;
+struct page;
 
 struct vm_region
 {
@@ -38,9 +49,23 @@ struct vm_region
 	unsigned long perms;
 	vm_object *vmo;
 	unsigned long off;
+	unsigned long flags;
+	struct address_space *as;
+
+	/* Other regions mapping the same vmo, see vm_object::add_mapping */
+	struct vm_region *vmo_prev;
+	struct vm_region *vmo_next;
+
+	/* Summary of the region's subtree in the address space tree, kept
+	 * up to date by vm_region_augment; lets allocation skip subtrees
+	 * that have no big enough hole */
+	unsigned long subtree_start;
+	unsigned long subtree_end;
+	size_t subtree_max_gap;
 };
 
 void vm_init(void);
+struct rb_tree *vm_create_area_tree(void);
 struct vm_region *vm_allocate_region(struct address_space *as,
 				     unsigned long min, size_t size);
 struct vm_region *vm_reserve_region(struct address_space *as,
@@ -66,6 +91,11 @@ protected:
 	unsigned long ip;
 	unsigned long FlagsToPerms();
 	enum VmFaultStatus TryToMapPage(struct vm_region *region);
+	void FaultAround(struct vm_region *region, unsigned long fault_addr);
+	enum VmFaultStatus MapPage(struct vm_region *region, unsigned long addr,
+				   struct page *page, unsigned long perms, bool shared,
+				   bool& needs_flush);
+	void FlushPage(unsigned long addr);
 public:
 	VmFault(bool is_user, bool is_write, bool is_exec,
 		unsigned long fault_address, unsigned long ip) : is_user(is_user),
@@ -77,14 +107,34 @@ public:
 	void Dump();
 };
 
+struct vm_fault_stats
+{
+	size_t faults;
+	/* Pages mapped by fault-around, i.e. faults that didn't happen */
+	size_t fault_around_pages;
+	/* Read faults on anonymous memory that mapped the zero page */
+	size_t zero_page_maps;
+	/* VM_HUGE_PAGE_SIZE mappings of huge-page vmos */
+	size_t huge_page_maps;
+};
+
+void GetFaultStats(struct vm_fault_stats *stats);
+/* Sets the fault-around window; 0 or 1 disables it. Rounded down to a
+ * power of two and capped at VM_FAULT_AROUND_MAX_PAGES. */
+void SetFaultAround(size_t nr_pages);
+
 struct vm_region *AllocateRegionInternal(struct address_space *as, unsigned long min,
 					 size_t size);
 struct vm_region *MmapInternal(struct address_space *as, unsigned long min, size_t size,
 			       unsigned long flags, vm_object *vmo);
 void *mmap(struct address_space *as, unsigned long min, size_t size, unsigned long flags);
+int PopulateRegion(struct address_space *as, struct vm_region *region);
 void *MmioMap(struct address_space *as, unsigned long phys, unsigned long min,
 	      size_t size, unsigned long flags);
 int munmap(struct address_space *as, void *addr, size_t size);
+/* Sets the VM_PROT_WRITE and VM_PROT_EXEC permissions of [addr, addr + size),
+ * splitting the regions that are only partly covered */
+int mprotect(struct address_space *as, void *addr, size_t size, unsigned long prot);
 
 void ForEveryRegion(struct address_space *as, bool (*)(struct vm_region *region));
 
@@ -104,6 +154,7 @@ inline struct address_space *get_current_address_space()
 }
 
 struct vm_region *FindRegion(void *addr, rb_tree *tree);
+struct vm_region *FindRegionCached(struct address_space *as, void *addr);
 
 #define MAP_FILE_FIXED		(1 << 0)
 #define MAP_FILE_SHARED		(1 << 1)
@@ -18,8 +18,8 @@
 #include <carbon/panic.h>
 #include <carbon/smart.h>
 #include <carbon/refcount.h>
+#include <carbon/radix_tree.h>
 
-#include <libdict/rb_tree.h>
 struct page;
 
 class vm_object : public refcountable
@@ -29,12 +29,21 @@ protected:
 	/* TODO: Create a list of owners when we're able to share VMOs */
 	struct vm_region *owner;
 	size_t nr_pages;
-	struct rb_tree page_list;
+	/* Resident pages, indexed by offset >> PAGE_SHIFT */
+	struct radix_tree page_index;
 	bool should_demand_page;
+	/* Regions the object is mapped by, protected by the lock */
+	struct vm_region *mappings;
+	/* Cow clones looking through to our pages */
+	unsigned long nr_clones;
 
 	void purge_pages(size_t lower_bound, size_t upper_bound, unsigned int flags, vm_object *second = nullptr);
-	void update_offsets(size_t old_off);
-	void destroy_tree(void (*func)(void *key, void *data));
+	virtual int update_offsets(size_t old_off);
+	int take_pages(vm_object *src, size_t off);
+	bool is_mapped_by(struct vm_region *region);
+	void unmap_range_from(struct address_space *as, struct vm_region *region,
+			      size_t offset, size_t size);
+	void destroy_tree(void (*func)(void *data));
 	struct page *get_may_commit_unlocked(size_t off);
 public:
 	Spinlock lock;
@@ -43,10 +52,9 @@ public:
 	vm_object(bool should_demand_page,
 		 size_t nr_pages,
 		 struct vm_region *owner)
-		 : owner(owner), nr_pages(nr_pages), lock()
+		 : owner(owner), nr_pages(nr_pages), page_index{}, mappings(nullptr),
+		   nr_clones(0), lock()
 	{
-		memset((void *) &page_list, 0, sizeof(page_list));
-		page_list.cmp_func = vm_cmp;
 	};
 
 
@@ -64,38 +72,185 @@ public:
 	virtual vm_object *create_hollow_copy() = 0;
 	virtual int populate(size_t starting_off, size_t region_size);
 
+	/* Whether commit() hands out VM_HUGE_PAGE_SIZE chunks that are worth
+	 * mapping with huge pages */
+	virtual bool huge_pages()
+	{
+		return false;
+	}
+
+	/* Returns the page at offset for a read-only mapping, with a reference
+	 * the caller drops with free_page() and no lock held, or nullptr if the
+	 * offset needs to be committed. shared is set when the page doesn't
+	 * belong to this object, in which case it can't be mapped writable. */
+	virtual struct page *get_readonly(size_t offset, bool& shared);
+
 	/* Generic functions */
 	struct page *get(size_t offset);
+
+	size_t get_size()
+	{
+		return nr_pages << PAGE_SHIFT;
+	}
+
+	/* Looks offset up without taking the lock. Nothing keeps the page
+	 * from being removed and freed meanwhile, so this is only for users
+	 * that never remove pages from under mappings, like the page cache. */
+	struct page *lookup(size_t offset)
+	{
+		return (struct page *) radix_tree_lookup(&page_index, offset >> PAGE_SHIFT);
+	}
+
+	size_t get_resident(size_t offset, size_t nr_pages, struct page **pages);
 	int resize(size_t new_size);
 	vm_object *split(size_t split_point, size_t hole_size);
 	void sanity_check();
-	void truncate_beginning_and_resize(size_t off);
+	int truncate_beginning_and_resize(size_t off);
 	size_t write(size_t offset, const void *src, size_t size);
 	size_t read(size_t offset, void *dst, size_t size);
 	size_t set_mem(size_t offset, uint8_t pattern, size_t size);
 
+	/* Copies between the object and user memory. Return 0, -EFAULT or
+	 * -ENOMEM. */
+	int read_user(size_t offset, void *ubuf, size_t size);
+	int write_user(size_t offset, const void *ubuf, size_t size);
+
+	/* Regions get added when a vmo is assigned to them, so that pages can
+	 * be taken away from under their mappings */
+	void add_mapping(struct vm_region *region);
+	void remove_mapping(struct vm_region *region);
+	/* True if region is the only thing referencing (and mapping) us */
+	bool mapped_only_by(struct vm_region *region);
+
+	/* Frees the pages in the page aligned [offset, offset + size) after
+	 * unmapping them everywhere. Offsets go back to reading as they did
+	 * before being committed. Fails with -EBUSY while there are clones,
+	 * since their mappings may be using our pages. */
+	int decommit(size_t offset, size_t size);
+	/* Makes [offset, offset + size) read as zeroes, committing as little
+	 * as possible */
+	int zero(size_t offset, size_t size);
+	int set_size(size_t size);
+
+	vm_object *create_cow_clone();
+
+	void add_clone()
+	{
+		__atomic_add_fetch(&nr_clones, 1, __ATOMIC_RELAXED);
+	}
+
+	void remove_clone()
+	{
+		__atomic_sub_fetch(&nr_clones, 1, __ATOMIC_RELAXED);
+	}
+
 	/* add_page and remove_page are dangerous, beware! */
 	int add_page(size_t page_off, struct page *page);
+	int add_pages(size_t offset, struct page **pages, size_t nr);
 	struct page *remove_page(size_t page_off);
+
+	/* Returns the page at offset with a reference and the lock dropped,
+	 * committing it if needed (always, if it's going to be written) */
+	struct page *get_page_ref(size_t offset, bool write);
 };
 
 /* Following this is a number of specializations of the vm_object class */
 
+/* Shared, never written page of zeroes */
+extern struct page *vm_zero_page;
+
 class vm_object_phys : public vm_object
 {
 protected:
+	/* Anonymous memory reads as zeroes until it's written, so read faults
+	 * on it can map vm_zero_page instead of committing. Only for vmos
+	 * that a single region maps: nothing zaps the zero page out of the
+	 * other mappings when a page gets committed. */
+	bool anonymous = false;
+
+	int commit_pages(size_t offset, size_t nr, struct page **pages);
 public:
 	using vm_object::vm_object;
 	~vm_object_phys() override;
 
+	void set_anonymous()
+	{
+		anonymous = true;
+	}
+
 	int commit(size_t offset) override;
+	int populate(size_t starting_off, size_t region_size) override;
+	struct page *get_readonly(size_t offset, bool& shared) override;
 	vm_object *create_hollow_copy()
 	{
 		vm_object_phys *p = new vm_object_phys(should_demand_page, nr_pages, owner);
+		if(p)
+			p->anonymous = anonymous;
 		return p;
 	}
 };
 
+/* Anonymous memory committed in VM_HUGE_PAGE_SIZE chunks of physically
+ * contiguous pages, so mappings that line up with them can use huge pages.
+ * Falls back to single pages once there's no contiguous memory left.
+ * Unlike vm_object_phys, reads commit too, as mapping the zero page would
+ * split the huge mapping.
+*/
+class vm_object_huge : public vm_object_phys
+{
+public:
+	using vm_object_phys::vm_object_phys;
+
+	int commit(size_t offset) override;
+
+	/* Single page commits would get in the way of the chunks */
+	int populate(size_t starting_off, size_t region_size) override
+	{
+		return vm_object::populate(starting_off, region_size);
+	}
+
+	bool huge_pages() override
+	{
+		return true;
+	}
+
+	vm_object *create_hollow_copy() override
+	{
+		return new vm_object_huge(should_demand_page, nr_pages, owner);
+	}
+};
+
+/* Copy-on-write child. Pages that haven't been written are looked up in the
+ * parent (which may itself be a vm_object_cow) and mapped read-only; commit()
+ * makes the private copy. Changes the parent makes to pages the child hasn't
+ * copied yet are visible to the child, like a MAP_PRIVATE file mapping.
+*/
+class vm_object_cow : public vm_object
+{
+protected:
+	vm_object *parent;
+	/* Where our offset 0 sits in the parent */
+	size_t parent_off;
+
+	int update_offsets(size_t old_off) override;
+public:
+	vm_object_cow(vm_object *parent, size_t parent_off, size_t nr_pages)
+		: vm_object(true, nr_pages, nullptr), parent(parent), parent_off(parent_off)
+	{
+		parent->ref();
+		parent->add_clone();
+	}
+
+	~vm_object_cow() override;
+
+	int commit(size_t offset) override;
+	struct page *get_readonly(size_t offset, bool& shared) override;
+	vm_object *create_hollow_copy() override
+	{
+		return new vm_object_cow(parent, parent_off, nr_pages);
+	}
+};
+
 class vm_object_mmio : public vm_object
 {
 private:
@@ -40,6 +40,7 @@
 #define LAPIC_TIMER_CURRCNT 0x390
 #define LAPIC_TIMER_IVT_MASK 0x10000
 #define LAPIC_LVT_TIMER_MODE_PERIODIC 0x20000
+#define LAPIC_ICR_DELIVERY_PENDING (1 << 12)
 #define APIC_DEFAULT_SPURIOUS_IRQ 15
 
 namespace x86
@@ -127,6 +128,7 @@ public:
 
 	void SetupTimer();
 	void SendSIPI(uint8_t id, IcrDeliveryMode mode, uint32_t page);
+	void SendIpi(uint8_t id, IcrDeliveryMode mode, Interrupt::InterruptVector vector);
 };
 
 constexpr unsigned int NumPins = 24;
@@ -137,6 +139,8 @@ Gsi MapSourceGsiToDest(Gsi source_gsi);
 Gsi MapDestGsiToSrc(Gsi dest_gsi);
 void Init();
 void SetupLapic();
+/* Sends a fixed IPI to cpu; must be called with interrupts disabled */
+void SendIpi(unsigned int cpu, Interrupt::InterruptVector vector);
 
 }
 
@@ -9,8 +9,15 @@
 
 #include <carbon/compiler.h>
 
+#define CR0_WP			(1 << 16)
+#define CR4_PGE			(1 << 7)
+#define CR4_PCIDE		(1 << 17)
 #define CR4_OSXSAVE		(1 << 18)
 
+#define CR3_PCID_MASK		(0xfffUL)
+/* Keeps the TLB entries tagged with the new PCID when loading cr3 */
+#define CR3_NOFLUSH		(1UL << 63)
+
 namespace x86
 {
 
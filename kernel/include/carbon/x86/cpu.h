@@ -188,6 +188,7 @@ namespace Cpu
 #define X86_FEATURE_PCX_L2I		(220)
 
 #define X86_MESSAGE_VECTOR		(130)
+#define X86_TLB_SHOOTDOWN_VECTOR	(131)
 
 struct cpu
 {
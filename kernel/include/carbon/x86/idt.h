@@ -21,7 +21,7 @@ struct IDT_entry
 {
 	uint16_t offset_low;
 	uint16_t selector;
-	uint8_t zero;/* unused, set to 0 */
+	uint8_t ist;/* interrupt stack table index, 0 for none */
 	uint8_t type_attr;
 	uint16_t offset_high;
 	uint32_t offset_top;
@@ -32,6 +32,7 @@ typedef struct IDT_entry idt_entry_t;
 
 void idt_create_descriptor(uint8_t entry, uint64_t offset, uint16_t selector, uint8_t flags);
 void idt_set_system_gate(uint8_t entry, uint64_t offset, uint16_t selector, uint8_t flags);
+void idt_set_ist(uint8_t entry, uint8_t ist);
 void idt_load();
 void x86_init_exceptions(void);
 void x86_reserve_vector(Interrupt::InterruptVector vector, void (*handler)());
@@ -68,6 +69,7 @@ extern "C" void isr28();
 extern "C" void isr29();
 extern "C" void isr30();
 extern "C" void isr31();
+extern "C" void x86_tlb_shootdown_ipi();
 extern "C" void irq0();
 extern "C" void irq1();
 extern "C" void irq2();
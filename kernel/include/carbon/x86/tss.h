@@ -9,6 +9,9 @@
 
 #include <stdint.h>
 
+/* Interrupt stack table entry double faults run on */
+#define TSS_DOUBLE_FAULT_IST		1
+
 namespace Tss
 {
 
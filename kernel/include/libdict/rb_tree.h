@@ -35,9 +35,13 @@ BEGIN_DECL
 
 typedef struct rb_node rb_node;
 
+/* Called bottom-up whenever a node's subtree changes, so callers can keep
+ * per-subtree summaries in their datums. Children may be NULL. */
+typedef void (*rb_augment_func)(void* datum, void* left_datum, void* right_datum);
+
 typedef struct rb_tree {
 	TREE_FIELDS(rb_node);
-
+	rb_augment_func	augment;
 } rb_tree;
 
 typedef struct rb_itor {
@@ -70,6 +74,17 @@ size_t		rb_tree_max_path_length(const rb_tree* tree);
 size_t		rb_tree_total_path_length(const rb_tree* tree);
 bool		rb_tree_verify(const rb_tree* tree);
 
+void		rb_tree_set_augment(rb_tree* tree, rb_augment_func augment);
+/* Recompute the augmented data from |key|'s node up to the root; needed after
+ * the datum or the summarised fields of an existing node change. */
+void		rb_tree_augment_update(rb_tree* tree, const void* key);
+
+/* Raw node access, for descents that are guided by the augmented data */
+rb_node*	rb_tree_root(const rb_tree* tree);
+rb_node*	rb_node_left(const rb_node* node);
+rb_node*	rb_node_right(const rb_node* node);
+void*		rb_node_datum(const rb_node* node);
+
 typedef struct rb_itor rb_itor;
 
 rb_itor*	rb_itor_new(rb_tree* tree);
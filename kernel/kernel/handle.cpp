@@ -10,6 +10,7 @@
 #include <carbon/handle_table.h>
 #include <carbon/syscall_utils.h>
 #include <carbon/utility.hpp>
+#include <carbon/slab.h>
 
 handle::handle(refcountable *ko, unsigned long __object_type, process *__owner) :
 	kernel_object(ko), object_type(__object_type), owner(__owner) 
@@ -22,6 +23,19 @@ handle::~handle()
 	unref();
 }
 
+static slab_cache handle_cache{"handle", sizeof(handle), alignof(handle), 0, nullptr};
+
+void *handle::operator new(size_t size)
+{
+	(void) size;
+	return slab_allocate(&handle_cache);
+}
+
+void handle::operator delete(void *ptr)
+{
+	slab_free(&handle_cache, ptr);
+}
+
 void handle::set_object(refcountable *ko)
 {
 	assert(kernel_object == nullptr);
@@ -100,6 +100,8 @@ static unsigned	delete_fixup(rb_tree* tree, rb_node* node, rb_node* parent, bool
 static rb_node*	node_new(void* key);
 static rb_node*	node_next(rb_node* node);
 static rb_node*	node_prev(rb_node* node);
+static void	augment_node(rb_tree* tree, rb_node* node);
+static void	augment_path(rb_tree* tree, rb_node* node);
 
 rb_tree*
 rb_tree_new(dict_compare_func cmp_func)
@@ -112,6 +114,7 @@ rb_tree_new(dict_compare_func cmp_func)
 	tree->count = 0;
 	tree->cmp_func = cmp_func;
 	tree->rotation_count = 0;
+	tree->augment = NULL;
     }
     return tree;
 }
@@ -199,6 +202,9 @@ rb_tree_insert(rb_tree* tree, void* key)
 	else
 	    parent->rlink = node;
 
+	/* Rotations only fix up their own two nodes, so the path has to be
+	 * consistent before rebalancing */
+	augment_path(tree, node);
 	tree->rotation_count += insert_fixup(tree, node);
     }
     tree->count++;
@@ -279,6 +285,9 @@ remove_node(rb_tree* tree, rb_node* node)
     bool left = xp && xp->llink == out;
     *(xp ? (xp->llink == out ? &xp->llink : &xp->rlink) : &tree->root) = x;
 
+    /* |node| got |out|'s datum and is an ancestor of |xp| (if distinct) */
+    augment_path(tree, xp);
+
     if (COLOR(out) == RB_BLACK && tree->root)
 	tree->rotation_count += delete_fixup(tree, x, xp, left);
     FREE(out);
@@ -431,6 +440,8 @@ rot_left(rb_tree* tree, rb_node* node)
     *(parent ? (parent->llink == node ? &parent->llink : &parent->rlink) : &tree->root) = rlink;
     rlink->llink = node;
     SET_PARENT(node, rlink);
+    augment_node(tree, node);
+    augment_node(tree, rlink);
 }
 
 static void
@@ -444,8 +455,58 @@ rot_right(rb_tree* tree, rb_node* node)
     *(parent ? (parent->llink == node ? &parent->llink : &parent->rlink) : &tree->root) = llink;
     llink->rlink = node;
     SET_PARENT(node, llink);
+    augment_node(tree, node);
+    augment_node(tree, llink);
+}
+
+static void
+augment_node(rb_tree* tree, rb_node* node)
+{
+    if (!tree->augment)
+	return;
+    tree->augment(node->datum, node->llink ? node->llink->datum : NULL,
+		  node->rlink ? node->rlink->datum : NULL);
 }
 
+static void
+augment_path(rb_tree* tree, rb_node* node)
+{
+    if (!tree->augment)
+	return;
+    for (; node; node = PARENT(node))
+	augment_node(tree, node);
+}
+
+static void
+augment_subtree(rb_tree* tree, rb_node* node)
+{
+    /* Children are summarised before their parents; the depth is bounded by
+     * the tree height */
+    if (!node)
+	return;
+    augment_subtree(tree, node->llink);
+    augment_subtree(tree, node->rlink);
+    augment_node(tree, node);
+}
+
+void
+rb_tree_set_augment(rb_tree* tree, rb_augment_func augment)
+{
+    tree->augment = augment;
+    augment_subtree(tree, tree->root);
+}
+
+void
+rb_tree_augment_update(rb_tree* tree, const void* key)
+{
+    augment_path(tree, tree_search_node(tree, key));
+}
+
+rb_node* rb_tree_root(const rb_tree* tree) { return tree->root; }
+rb_node* rb_node_left(const rb_node* node) { return node->llink; }
+rb_node* rb_node_right(const rb_node* node) { return node->rlink; }
+void* rb_node_datum(const rb_node* node) { return node->datum; }
+
 static rb_node*
 node_new(void* key)
 {
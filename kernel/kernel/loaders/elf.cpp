@@ -145,7 +145,8 @@ cbn_status_t elf_loader::load(fs::auto_inode& file, program_loader::binary_info&
 		/* TODO: Sanitize addresses */
 		void *addr = Vm::map_file(&out.proc->address_space,
 					  (void *) aligned_address,
-			     		  MAP_FILE_FIXED, prot, size, mapping_off, file);
+			     		  MAP_FILE_FIXED | MAP_FILE_PRIVATE, prot, size,
+					  mapping_off, file);
 		if(!addr)
 		{
 			return CBN_STATUS_OUT_OF_MEMORY;
@@ -76,4 +76,9 @@ bool percpu_initialized()
 	return percpu_init;
 }
 
+}
+
+extern "C" bool percpu_is_initialized(void)
+{
+	return Percpu::percpu_init;
 }
\ No newline at end of file
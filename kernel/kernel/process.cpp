@@ -86,7 +86,7 @@ bool process::initialize_address_space()
 {
 	address_space.start = (unsigned long) vm::limits::user_min;
 	address_space.end = (unsigned long) vm::limits::user_max;
-	address_space.area_tree = rb_tree_new(vm_cmp);
+	address_space.area_tree = vm_create_area_tree();
 
 	if(!address_space.area_tree)
 		return false;
@@ -201,7 +201,7 @@ thread *process::create_thread(scheduler::thread_callback entry, void *arg, void
 size_t process::write_memory(void *address, void *src, size_t len, cbn_status_t& out_status)
 {
 	size_t written = 0;
-	scoped_spinlock guard {&address_space.lock};
+	scoped_rw_spinlock<scoped_rwlock_read> guard{&address_space.lock};
 
 	unsigned long a = (unsigned long) address;
 	const uint8_t *s = (const uint8_t *) src; 
@@ -236,7 +236,7 @@ size_t process::write_memory(void *address, void *src, size_t len, cbn_status_t&
 size_t process::set_memory(void *address, uint8_t pattern, size_t len, cbn_status_t& out_status)
 {
 	size_t written = 0;
-	scoped_spinlock guard {&address_space.lock};
+	scoped_rw_spinlock<scoped_rwlock_read> guard{&address_space.lock};
 
 	unsigned long a = (unsigned long) address;
 
@@ -263,7 +263,7 @@ size_t process::set_memory(void *address, uint8_t pattern, size_t len, cbn_statu
 size_t process::read_memory(void *address, void *dest, size_t len, cbn_status_t& out_status)
 {
 	size_t been_read = 0;
-	scoped_spinlock guard {&address_space.lock};
+	scoped_rw_spinlock<scoped_rwlock_read> guard{&address_space.lock};
 
 	unsigned long a = (unsigned long) address;
 	uint8_t *d = (uint8_t *) dest;
@@ -0,0 +1,294 @@
+/*
+* Copyright (c) 2019 Pedro Falcato
+* This file is part of Carbon, and is released under the terms of the MIT License
+* check LICENSE at the root directory for more information
+*/
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <carbon/radix_tree.h>
+#include <carbon/slab.h>
+
+static slab_cache radix_tree_node_cache{"radix_tree_node", sizeof(struct radix_tree_node),
+					alignof(struct radix_tree_node), 0, nullptr};
+
+static struct radix_tree_node *radix_node_alloc(unsigned int shift)
+{
+	auto node = (struct radix_tree_node *) slab_allocate(&radix_tree_node_cache);
+
+	if(!node)
+		return nullptr;
+
+	memset(node, 0, sizeof(*node));
+	node->shift = shift;
+
+	return node;
+}
+
+/* Largest index a node at shift covers */
+static inline unsigned long radix_node_max_index(unsigned int shift)
+{
+	unsigned int bits = shift + RADIX_TREE_MAP_SHIFT;
+
+	return bits >= sizeof(unsigned long) * 8 ? ~0UL : (1UL << bits) - 1;
+}
+
+static inline unsigned int radix_slot(unsigned long index, unsigned int shift)
+{
+	return (index >> shift) & RADIX_TREE_MAP_MASK;
+}
+
+/* Nodes and items are published with release stores by writers, so lockless
+ * readers always see them fully initialised */
+template <typename T>
+static inline T radix_load(T& slot)
+{
+	return __atomic_load_n(&slot, __ATOMIC_ACQUIRE);
+}
+
+static struct radix_tree_node *radix_find_leaf(struct radix_tree *tree, unsigned long index)
+{
+	struct radix_tree_node *node = radix_load(tree->root);
+
+	if(!node || index > radix_node_max_index(node->shift))
+		return nullptr;
+
+	while(node && node->shift)
+		node = (struct radix_tree_node *) radix_load(node->slots[radix_slot(index, node->shift)]);
+
+	return node;
+}
+
+void *radix_tree_lookup(struct radix_tree *tree, unsigned long index)
+{
+	struct radix_tree_node *leaf = radix_find_leaf(tree, index);
+
+	return leaf ? radix_load(leaf->slots[index & RADIX_TREE_MAP_MASK]) : nullptr;
+}
+
+size_t radix_tree_gang_lookup(struct radix_tree *tree, unsigned long first, size_t nr,
+			      void **items)
+{
+	size_t found = 0;
+	size_t i = 0;
+
+	while(i < nr)
+	{
+		unsigned long index = first + i;
+		size_t in_leaf = RADIX_TREE_MAP_SIZE - (index & RADIX_TREE_MAP_MASK);
+
+		if(in_leaf > nr - i)
+			in_leaf = nr - i;
+
+		/* One walk per leaf instead of one per item */
+		struct radix_tree_node *leaf = radix_find_leaf(tree, index);
+
+		for(size_t j = 0; j < in_leaf; j++, i++)
+		{
+			items[i] = leaf ? radix_load(leaf->slots[(index + j) & RADIX_TREE_MAP_MASK]) :
+				   nullptr;
+			if(items[i])
+				found++;
+		}
+	}
+
+	return found;
+}
+
+static void *radix_node_next(struct radix_tree_node *node, unsigned long *index)
+{
+	unsigned long start = *index;
+
+	for(unsigned int i = radix_slot(start, node->shift); i < RADIX_TREE_MAP_SIZE; i++)
+	{
+		void *slot = radix_load(node->slots[i]);
+
+		if(!slot)
+			continue;
+
+		/* First index under slots[i], unless we started halfway into it */
+		unsigned long base = (start & ~radix_node_max_index(node->shift)) |
+				     ((unsigned long) i << node->shift);
+		if(base < start)
+			base = start;
+
+		if(node->shift == 0)
+		{
+			*index = base;
+			return slot;
+		}
+
+		void *item = radix_node_next((struct radix_tree_node *) slot, &base);
+
+		if(item)
+		{
+			*index = base;
+			return item;
+		}
+	}
+
+	return nullptr;
+}
+
+void *radix_tree_next(struct radix_tree *tree, unsigned long *index)
+{
+	struct radix_tree_node *root = radix_load(tree->root);
+
+	if(!root || *index > radix_node_max_index(root->shift))
+		return nullptr;
+
+	return radix_node_next(root, index);
+}
+
+/* Adds levels on top of the root until index fits */
+static int radix_tree_grow(struct radix_tree *tree, unsigned long index)
+{
+	struct radix_tree_node *root = tree->root;
+
+	if(!root)
+	{
+		unsigned int shift = 0;
+
+		while(index > radix_node_max_index(shift))
+			shift += RADIX_TREE_MAP_SHIFT;
+
+		if(!(root = radix_node_alloc(shift)))
+			return -ENOMEM;
+
+		__atomic_store_n(&tree->root, root, __ATOMIC_RELEASE);
+		return 0;
+	}
+
+	while(index > radix_node_max_index(root->shift))
+	{
+		struct radix_tree_node *node = radix_node_alloc(root->shift + RADIX_TREE_MAP_SHIFT);
+
+		if(!node)
+			return -ENOMEM;
+
+		node->slots[0] = root;
+		node->count = 1;
+
+		__atomic_store_n(&tree->root, node, __ATOMIC_RELEASE);
+		root = node;
+	}
+
+	return 0;
+}
+
+/* Returns the leaf index goes in, creating the path to it if needed */
+static struct radix_tree_node *radix_tree_get_leaf(struct radix_tree *tree, unsigned long index)
+{
+	if(radix_tree_grow(tree, index) < 0)
+		return nullptr;
+
+	struct radix_tree_node *node = tree->root;
+
+	while(node->shift)
+	{
+		unsigned int i = radix_slot(index, node->shift);
+		struct radix_tree_node *child = (struct radix_tree_node *) node->slots[i];
+
+		if(!child)
+		{
+			if(!(child = radix_node_alloc(node->shift - RADIX_TREE_MAP_SHIFT)))
+				return nullptr;
+
+			__atomic_store_n(&node->slots[i], (void *) child, __ATOMIC_RELEASE);
+			node->count++;
+		}
+
+		node = child;
+	}
+
+	return node;
+}
+
+long radix_tree_insert_range(struct radix_tree *tree, unsigned long first, void **items,
+			     size_t nr)
+{
+	size_t done = 0;
+
+	while(done < nr)
+	{
+		unsigned long index = first + done;
+		struct radix_tree_node *leaf = radix_tree_get_leaf(tree, index);
+
+		if(!leaf)
+			return done ? (long) done : -ENOMEM;
+
+		for(unsigned int i = index & RADIX_TREE_MAP_MASK; i < RADIX_TREE_MAP_SIZE && done < nr;
+		    i++, done++)
+		{
+			assert(items[done] != nullptr);
+
+			if(leaf->slots[i])
+				return done ? (long) done : -EEXIST;
+
+			__atomic_store_n(&leaf->slots[i], items[done], __ATOMIC_RELEASE);
+			leaf->count++;
+			tree->nr_items++;
+		}
+	}
+
+	return done;
+}
+
+int radix_tree_insert(struct radix_tree *tree, unsigned long index, void *item)
+{
+	long st = radix_tree_insert_range(tree, index, &item, 1);
+
+	return st < 0 ? (int) st : 0;
+}
+
+void *radix_tree_delete(struct radix_tree *tree, unsigned long index)
+{
+	struct radix_tree_node *leaf = radix_find_leaf(tree, index);
+
+	if(!leaf)
+		return nullptr;
+
+	unsigned int i = index & RADIX_TREE_MAP_MASK;
+	void *item = leaf->slots[i];
+
+	if(!item)
+		return nullptr;
+
+	/* The node stays, even if it's empty now; readers may be looking at it */
+	__atomic_store_n(&leaf->slots[i], nullptr, __ATOMIC_RELEASE);
+	leaf->count--;
+	tree->nr_items--;
+
+	return item;
+}
+
+static void radix_node_destroy(struct radix_tree_node *node, void (*func)(void *item))
+{
+	for(unsigned int i = 0; i < RADIX_TREE_MAP_SIZE && node->count; i++)
+	{
+		void *slot = node->slots[i];
+
+		if(!slot)
+			continue;
+
+		if(node->shift)
+			radix_node_destroy((struct radix_tree_node *) slot, func);
+		else if(func)
+			func(slot);
+
+		node->count--;
+	}
+
+	slab_free(&radix_tree_node_cache, node);
+}
+
+void radix_tree_destroy(struct radix_tree *tree, void (*func)(void *item))
+{
+	if(tree->root)
+		radix_node_destroy(tree->root, func);
+
+	tree->root = nullptr;
+	tree->nr_items = 0;
+}
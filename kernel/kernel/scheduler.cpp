@@ -19,6 +19,8 @@
 #include <carbon/mutex.h>
 #include <carbon/rwlock.h>
 #include <carbon/atomic.h>
+#include <carbon/page.h>
+#include <carbon/slab.h>
 
 extern struct serial_port com1;
 void serial_write(const char *s, size_t size, struct serial_port *port);
@@ -47,6 +49,19 @@ bool create_fpu_area(struct thread *t)
 	return true;
 }
 
+static slab_cache thread_cache{"thread", sizeof(thread), alignof(thread), 0, nullptr};
+
+void *thread::operator new(size_t size)
+{
+	(void) size;
+	return slab_allocate(&thread_cache);
+}
+
+void thread::operator delete(void *ptr)
+{
+	slab_free(&thread_cache, ptr);
+}
+
 struct thread *create_thread(struct registers *regs, create_thread_flags flags)
 {
 	thread *t = new thread;
@@ -122,7 +137,12 @@ void idle_thread(void *context)
 	(void) context;
 
 	while(true)
-		__asm__ __volatile__("hlt");
+	{
+		/* Use the spare cycles to pre-zero pages, and only halt
+		 * when there's nothing left to do */
+		if(!Page::ZeroPoolWork())
+			__asm__ __volatile__("hlt");
+	}
 }
 
 void initialize_idle_thread()
@@ -59,4 +59,14 @@ unsigned int GetOnlineCpus()
 	return online_cpus;
 }
 
+unsigned int GetNrCpus()
+{
+	return nr_cpus;
+}
+
+bool IsOnline(unsigned int cpu)
+{
+	return cpu < nr_cpus && bt.IsSet(cpu);
+}
+
 }
\ No newline at end of file
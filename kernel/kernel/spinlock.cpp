@@ -5,6 +5,7 @@
 */
 #include <carbon/lock.h>
 #include <carbon/scheduler.h>
+#include <carbon/tlb.h>
 #ifdef __x86_64__
 #include <carbon/x86/eflags.h>
 #endif
@@ -15,7 +16,11 @@ void spin_lock(struct spinlock *lock)
 	while(__sync_lock_test_and_set(&lock->lock, 1))
 	{
 		while(lock->lock == 1)
+		{
+			/* The holder may be waiting on us to flush our TLB */
+			tlb_poll_shootdowns();
 			__asm__ __volatile__("pause");
+		}
 	}
 
 #ifdef CONFIG_SPINLOCK_HOLDER
@@ -80,4 +85,68 @@ void Spinlock::UnlockIrqrestore()
 bool Spinlock::IsLocked()
 {
 	return lock.lock;
-}
\ No newline at end of file
+}
+rw_spinlock::~rw_spinlock()
+{
+	assert(counter == 0);
+}
+
+void rw_spinlock::lock_read()
+{
+	scheduler::disable_preemption();
+
+	while(true)
+	{
+		unsigned long c = __atomic_load_n(&counter, __ATOMIC_RELAXED);
+
+		if(!(c & (writer_held | writer_waiting)) &&
+		   __atomic_compare_exchange_n(&counter, &c, c + 1, false,
+					       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+
+		tlb_poll_shootdowns();
+		__asm__ __volatile__("pause");
+	}
+}
+
+void rw_spinlock::unlock_read()
+{
+	assert((counter & ~writer_waiting) != 0);
+	__atomic_sub_fetch(&counter, 1, __ATOMIC_RELEASE);
+
+	scheduler::enable_preemption();
+}
+
+void rw_spinlock::lock_write()
+{
+	scheduler::disable_preemption();
+
+	while(true)
+	{
+		unsigned long c = __atomic_load_n(&counter, __ATOMIC_RELAXED);
+
+		if((c & ~writer_waiting) == 0)
+		{
+			if(__atomic_compare_exchange_n(&counter, &c, writer_held, false,
+						       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return;
+			continue;
+		}
+
+		/* Hold off new readers until the current ones drain */
+		if(!(c & writer_waiting))
+			__atomic_fetch_or(&counter, writer_waiting, __ATOMIC_RELAXED);
+
+		tlb_poll_shootdowns();
+		__asm__ __volatile__("pause");
+	}
+}
+
+void rw_spinlock::unlock_write()
+{
+	assert(counter & writer_held);
+	/* Clears writer_waiting too; other waiting writers set it again */
+	__atomic_store_n(&counter, 0, __ATOMIC_RELEASE);
+
+	scheduler::enable_preemption();
+}
@@ -7,6 +7,7 @@
 #include <carbon/list.h>
 #include <carbon/lock.h>
 #include <carbon/panic.h>
+#include <carbon/slab.h>
 
 namespace Timer
 {
@@ -14,6 +15,19 @@ namespace Timer
 static LinkedList<TimerEvent*> pending_list;
 static Spinlock list_lock;
 
+static slab_cache timer_event_cache{"TimerEvent", sizeof(TimerEvent), alignof(TimerEvent), 0, nullptr};
+
+void *TimerEvent::operator new(size_t size)
+{
+	(void) size;
+	return slab_allocate(&timer_event_cache);
+}
+
+void TimerEvent::operator delete(void *ptr)
+{
+	slab_free(&timer_event_cache, ptr);
+}
+
 bool AddTimerEvent(TimerEvent& event)
 {
 	scoped_spinlock_irqsave guard {&list_lock};
@@ -0,0 +1,90 @@
+/*
+* Copyright (c) 2019 Pedro Falcato
+* This file is part of Carbon, and is released under the terms of the MIT License
+* check LICENSE at the root directory for more information
+*/
+#include <stddef.h>
+#include <stdint.h>
+
+#include <carbon/kstack.h>
+#include <carbon/vm.h>
+#include <carbon/page.h>
+#include <carbon/lock.h>
+
+/* Stacks are carved out of areas of the kernel address space; each slot is a
+ * guard page followed by the stack */
+#define KSTACK_SLOT_SIZE		(KSTACK_GUARD_SIZE + KSTACK_SIZE)
+#define KSTACK_AREA_SLOTS		64
+
+static struct spinlock kstack_area_lock = {};
+static unsigned long kstack_area_next = 0;
+static unsigned long kstack_area_end = 0;
+
+/* Returns the base of a new slot's stack, reserving a new area if needed */
+static unsigned long kstack_get_slot()
+{
+	spin_lock(&kstack_area_lock);
+
+	if(kstack_area_next == kstack_area_end)
+	{
+		struct vm_region *region;
+
+		{
+			/* No vmo, so faults in the guard pages never get
+			 * anything mapped */
+			scoped_rw_spinlock<scoped_rwlock_write> guard{&kernel_address_space.lock};
+			region = vm_allocate_region(&kernel_address_space, 0,
+						    KSTACK_AREA_SLOTS * KSTACK_SLOT_SIZE);
+		}
+
+		if(!region)
+		{
+			spin_unlock(&kstack_area_lock);
+			return 0;
+		}
+
+		kstack_area_next = region->start;
+		kstack_area_end = region->start + region->size;
+	}
+
+	unsigned long slot = kstack_area_next;
+	kstack_area_next += KSTACK_SLOT_SIZE;
+
+	spin_unlock(&kstack_area_lock);
+
+	return slot + KSTACK_GUARD_SIZE;
+}
+
+/* Stacks are never freed, as nothing tears threads down yet */
+void *kstack_alloc()
+{
+	struct page *pages = alloc_pages(KSTACK_PAGES, PAGE_ALLOC_NOZERO);
+
+	if(!pages)
+		return nullptr;
+
+	unsigned long base = kstack_get_slot();
+
+	if(!base)
+	{
+		free_pages(pages);
+		return nullptr;
+	}
+
+	unsigned long addr = base;
+
+	for(struct page *p = pages; p; p = p->next_un.next_allocation, addr += PAGE_SIZE)
+	{
+		if(__map_phys_range(kernel_address_space.arch_priv, addr, (uintptr_t) p->paddr,
+				    PAGE_SIZE, VM_PROT_WRITE) < 0)
+		{
+			/* The slot is lost, but there's plenty of address space */
+			if(addr != base)
+				unmap_page_range(&kernel_address_space, (void *) base, addr - base);
+			free_pages(pages);
+			return nullptr;
+		}
+	}
+
+	return (void *) (base + KSTACK_SIZE);
+}
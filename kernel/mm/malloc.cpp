@@ -17,11 +17,24 @@
 #include <carbon/memory.h>
 #include <carbon/page.h>
 #include <carbon/heap.h>
+#include <carbon/mmu_gather.h>
+#include <carbon/percpu.h>
+#include <carbon/scheduler.h>
+#include <carbon/tlb.h>
+
+#include <carbon/x86/cpu.h>
 
 static struct heap heap = {};
 uintptr_t starting_address = 0;
 Spinlock heap_lock{};
 
+/* Pages the break was lowered past that still need to be unmapped. That
+ * waits for every cpu to flush its TLB, so it's done without heap_lock;
+ * nothing grows the heap back over them in the meantime. */
+static bool heap_trimming = false;
+static uintptr_t heap_trim_start;
+static size_t heap_trim_pages;
+
 extern "C"
 struct heap *heap_get()
 {
@@ -38,15 +51,113 @@ void heap_set_start(uintptr_t heap_start)
 
 int kasan_alloc_shadow(unsigned long addr, size_t size, bool accessible);
 
+/* Grow the heap by at least this much at a time, so sbrk doesn't end up
+ * mapping a handful of pages on every other malloc */
+#define HEAP_GROWTH_MIN_PAGES		64
+
+static void *heap_map(void *addr, unsigned int nr_pages)
+{
+	struct page *pages = alloc_pages(nr_pages, 0);
+	if(!pages)
+		return NULL;
+
+	uintptr_t a = (uintptr_t) addr;
+	struct page *p = pages;
+
+	/* Physically contiguous runs get mapped in one walk */
+	while(p)
+	{
+		uintptr_t phys = (uintptr_t) p->paddr;
+		size_t len = 0;
+
+		do
+		{
+			len += PAGE_SIZE;
+			p = p->next_un.next_allocation;
+		} while(p && (uintptr_t) p->paddr == phys + len);
+
+		if(__map_phys_range(kernel_address_space.arch_priv, a, phys, len,
+				    VM_PROT_WRITE) < 0)
+		{
+			/* Nothing past the heap's size is in use, so just
+			 * tear down whatever did get mapped */
+			unmap_page_range(kernel_as, addr, (size_t) nr_pages << PAGE_SHIFT);
+			free_pages(pages);
+			return NULL;
+		}
+
+		a += len;
+	}
+
+	for(p = pages; p; )
+	{
+		struct page *next = p->next_un.next_allocation;
+		p->next_un.next_allocation = NULL;
+		p = next;
+	}
+
+	return addr;
+}
+
+static void heap_unmap(void *addr, size_t nr_pages)
+{
+	struct mmu_gather tlb;
+
+	mmu_gather_init(&tlb, kernel_as);
+
+	/* The pages go back once stale TLB entries can't reach them anymore */
+	tlb.free_mapped = true;
+	unmap_page_range_gather(&tlb, addr, nr_pages << PAGE_SHIFT);
+
+	mmu_gather_flush(&tlb);
+}
+
+/* Drops the pages past the (page aligned) break from the heap. Returns true
+ * if they need to be handed to heap_trim_finish() once heap_lock is dropped. */
+static bool heap_shrink()
+{
+	uintptr_t start = (uintptr_t) heap.starting_address;
+	size_t new_size = page_align_up((uintptr_t) heap.brk) - start;
+
+	/* If a trim is in progress, the pages stay mapped until a later one */
+	if(new_size >= heap.size || heap_trimming)
+		return false;
+
+	heap_trim_start = start + new_size;
+	heap_trim_pages = (heap.size - new_size) >> PAGE_SHIFT;
+	heap_trimming = true;
+	heap.size = new_size;
+
+	/* Whoever needs to grow the heap spins until we're done, so don't
+	 * get preempted in between */
+	scheduler::disable_preemption();
+
+	return true;
+}
+
+static void heap_trim_finish()
+{
+	heap_unmap((void *) heap_trim_start, heap_trim_pages);
+
+	heap_lock.Lock();
+	__atomic_store_n(&heap_trimming, false, __ATOMIC_RELEASE);
+	heap_lock.Unlock();
+
+	scheduler::enable_preemption();
+}
+
 void *expand_heap(size_t size)
 {
 	size_t nr_pages = (size >> PAGE_SHIFT) + 3;
 
+	if(nr_pages < HEAP_GROWTH_MIN_PAGES)
+		nr_pages = HEAP_GROWTH_MIN_PAGES;
+
 	void *alloc_start = (void *) ((char *) heap.starting_address + heap.size);
 #if 0
 	printf("Expanding heap from %p to %lx\n", alloc_start, (unsigned long) alloc_start + (nr_pages << PAGE_SHIFT));
 #endif
-	if(!map_pages(alloc_start, VM_PROT_WRITE, nr_pages))
+	if(!heap_map(alloc_start, nr_pages))
 		return NULL;
 	
 	heap.size += nr_pages << PAGE_SHIFT;
@@ -59,9 +170,40 @@ void *do_brk_change(intptr_t inc)
 	assert(heap.brk != NULL);
 	scoped_spinlock guard{&heap_lock};
 
+	/* The pages right above the heap may still be on their way out */
+	while(inc > 0 && heap_trimming)
+	{
+		guard.unlock();
+
+		while(__atomic_load_n(&heap_trimming, __ATOMIC_ACQUIRE))
+		{
+			tlb_poll_shootdowns();
+			x86::Cpu::Relax();
+		}
+
+		guard.lock();
+	}
+
 	void *old_brk = heap.brk;
 
 	uintptr_t new_brk = (uintptr_t) heap.brk + inc;
+
+	if(inc < 0)
+	{
+		if(new_brk < (uintptr_t) heap.starting_address)
+			return errno = EINVAL, (void *) -1;
+
+		heap.brk = (void *) new_brk;
+		bool unmap = heap_shrink();
+
+		guard.unlock();
+
+		if(unmap)
+			heap_trim_finish();
+
+		return old_brk;
+	}
+
 	uintptr_t starting_address = (uintptr_t) heap.starting_address;
 	unsigned long heap_limit = starting_address + heap.size;
 	if(new_brk >= heap_limit)
@@ -84,6 +226,48 @@ extern "C" void *sbrk(intptr_t increment)
 	return ret;
 }
 
+extern "C" int __heap_trim(size_t release, int *pending)
+{
+	scoped_spinlock guard{&heap_lock};
+
+	uintptr_t new_brk = (uintptr_t) heap.brk - release;
+
+	if(new_brk < (uintptr_t) heap.starting_address)
+		return errno = EINVAL, -1;
+
+	heap.brk = (void *) new_brk;
+	*pending = heap_shrink();
+
+	return 0;
+}
+
+extern "C" void __heap_trim_finish(void)
+{
+	heap_trim_finish();
+}
+
+extern "C" long malloc_bytes_in_use;
+extern "C" long malloc_early_bytes_in_use;
+
+namespace Heap
+{
+
+void GetStats(struct heap_usage *usage)
+{
+	long in_use = malloc_early_bytes_in_use;
+
+	if(Percpu::percpu_initialized())
+	{
+		for(unsigned long i = 0; i < Percpu::nr_bases; i++)
+			in_use += other_cpu_get(malloc_bytes_in_use, i);
+	}
+
+	usage->resident = heap.size;
+	usage->in_use = in_use;
+}
+
+}
+
 void *zalloc(size_t size)
 {
 	return calloc(1, size);
@@ -22,8 +22,8 @@ void *sbrk(intptr_t);
 
 void *__expand_heap(size_t *pn)
 {
-	static uintptr_t brk;
 	size_t n = *pn;
+	void *p;
 
 	if (n > SIZE_MAX/2 - PAGE_SIZE) {
 		errno = ENOMEM;
@@ -31,15 +31,11 @@ void *__expand_heap(size_t *pn)
 	}
 	n += -n & (PAGE_SIZE-1);
 
-	if (!brk) {
-		brk = get_brk();
-		brk += -brk & (PAGE_SIZE-1);
-	}
-
-	if (n < SIZE_MAX-brk && sbrk(n) != (void *) -1) {
+	/* Don't cache the break, the heap can shrink under us when the
+	 * allocator trims the top of the heap. */
+	if (n < SIZE_MAX-get_brk() && (p = sbrk(n)) != (void *) -1) {
 		*pn = n;
-		brk += n;
-		return (void *)(brk-n);
+		return p;
 	}
 
 	return 0;
@@ -7,6 +7,8 @@
 
 #include <carbon/lock.h>
 #include <carbon/panic.h>
+#include <carbon/percpu.h>
+#include <carbon/x86/eflags.h>
 
 #include "malloc_impl.h"
 
@@ -20,6 +22,48 @@ static struct {
 	struct spinlock free_lock;
 } mal;
 
+/* Per-cpu cache of small chunks in front of the shared bins. Cached chunks
+ * stay marked as in use, so nothing tries to coalesce with them; they're
+ * only handed back to the bins in batches. Each cache bin holds chunks of
+ * exactly (i + 1) * SIZE_ALIGN bytes. */
+#define TCACHE_BINS 16
+#define TCACHE_FILL 16
+#define TCACHE_MAX 64
+
+struct tcache_bin {
+	size_t count;
+	struct chunk *head;
+};
+
+struct tcache {
+	struct tcache_bin bins[TCACHE_BINS];
+};
+
+PER_CPU_VAR(struct tcache malloc_tcache);
+
+/* Bytes handed out to callers, as opposed to sitting in the bins or the
+ * tcaches; see Heap::GetStats. */
+PER_CPU_VAR(long malloc_bytes_in_use);
+long malloc_early_bytes_in_use;
+
+static inline void account(long delta)
+{
+	if (percpu_is_initialized())
+		add_per_cpu(malloc_bytes_in_use, delta);
+	else
+		malloc_early_bytes_in_use += delta;
+}
+
+/* Once the free chunk at the top of the heap grows past
+ * TRIM_THRESHOLD + TRIM_PAD, everything but TRIM_PAD bytes of it is
+ * given back to the page allocator. The pad keeps us from bouncing
+ * pages in and out of the heap. */
+#define TRIM_THRESHOLD (1024*1024)
+#define TRIM_PAD (256*1024)
+
+static struct spinlock heap_lock;
+static void *heap_end;
+
 
 /* Synchronization tools */
 
@@ -125,11 +169,15 @@ void __dump_heap(int x)
 #endif
 
 void *__expand_heap(size_t *);
+void *sbrk(intptr_t);
+/* Lowers the break like sbrk(-release); if *pending gets set, the pages
+ * still have to be unmapped by __heap_trim_finish(), which waits for the
+ * TLB shootdown and so mustn't be called with heap_lock held. */
+int __heap_trim(size_t release, int *pending);
+void __heap_trim_finish(void);
 
 static struct chunk *expand_heap(size_t n)
 {
-	static struct spinlock heap_lock;
-	static void *end;
 	void *p;
 	struct chunk *w;
 
@@ -148,7 +196,7 @@ static struct chunk *expand_heap(size_t n)
 
 	/* If not just expanding existing space, we need to make a
 	 * new sentinel chunk below the allocated space. */
-	if (p != end) {
+	if (p != heap_end) {
 		/* Valid/safe because of the prologue increment. */
 		n -= SIZE_ALIGN;
 		p = (char *)p + SIZE_ALIGN;
@@ -157,8 +205,8 @@ static struct chunk *expand_heap(size_t n)
 	}
 
 	/* Record new heap end and fill in footer. */
-	end = (char *)p + n;
-	w = MEM_TO_CHUNK(end);
+	heap_end = (char *)p + n;
+	w = MEM_TO_CHUNK(heap_end);
 	w->psize = n | C_INUSE;
 	w->csize = 0 | C_INUSE;
 
@@ -284,19 +332,11 @@ static void trim(struct chunk *self, size_t n)
 	free(CHUNK_TO_MEM(split));
 }
 
-void *malloc(size_t n)
+static struct chunk *malloc_chunk(size_t n)
 {
-	size_t orig_size = n;
-	(void) orig_size;
 	struct chunk *c;
 	int i, j;
 
-	if (adjust_size(&n) < 0) return 0;
-
-	if (n > MMAP_THRESHOLD) {
-		panic("malloc: Allocation too big.");
-	}
-
 	i = bin_index_up(n);
 	for (;;) {
 		uint64_t mask = mal.binmap & -(1ULL<<i);
@@ -323,8 +363,149 @@ void *malloc(size_t n)
 		unlock_bin(j);
 	}
 
+	account(CHUNK_SIZE(c));
+
 	/* Now patch up in case we over-allocated */
 	trim(c, n);
+	return c;
+}
+
+static inline struct tcache *tcache_get(void)
+{
+	return (struct tcache *) get_per_cpu_ptr_no_cast(malloc_tcache);
+}
+
+static inline int tcache_index(size_t n)
+{
+	return n / SIZE_ALIGN - 1;
+}
+
+static struct chunk *tcache_alloc(size_t n)
+{
+	struct tcache_bin *b;
+	struct chunk *c, *piece = 0, *next;
+	unsigned long flags;
+	size_t nr, k, cached = 0;
+	int i = tcache_index(n);
+
+	if (i >= TCACHE_BINS || !percpu_is_initialized()) return 0;
+
+	flags = irq_save_and_disable();
+	b = &tcache_get()->bins[i];
+	if ((c = b->head)) {
+		b->head = c->next;
+		b->count--;
+	}
+	irq_restore(flags);
+
+	if (c) {
+		account(n);
+		return c;
+	}
+
+	/* Refill by carving a single chunk from the bins into TCACHE_FILL
+	 * chunks of size n, so we only go through the bin locks once. */
+	c = malloc_chunk(n * TCACHE_FILL);
+	if (!c) return 0;
+
+	nr = CHUNK_SIZE(c) / n;
+	next = NEXT_CHUNK(c);
+
+	/* Leftovers (if any) stay with the last piece, which then gets
+	 * freed normally instead of cached. */
+	for (k = 1; k < nr; k++) {
+		piece = (struct chunk *)((char *)c + k * n);
+		piece->psize = n | C_INUSE;
+		piece->csize = (k == nr - 1 ? (size_t)((char *)next - (char *)piece) : n) | C_INUSE;
+	}
+
+	if (nr > 1) {
+		c->csize = n | C_INUSE;
+		next->psize = ((char *)next - (char *)piece) | C_INUSE;
+	}
+
+	flags = irq_save_and_disable();
+	b = &tcache_get()->bins[i];
+	for (k = 1; k < nr; k++) {
+		piece = (struct chunk *)((char *)c + k * n);
+		if (CHUNK_SIZE(piece) != n) {
+			irq_restore(flags);
+			__bin_chunk(piece);
+			flags = irq_save_and_disable();
+			b = &tcache_get()->bins[i];
+			continue;
+		}
+		piece->next = b->head;
+		b->head = piece;
+		b->count++;
+		cached++;
+	}
+	irq_restore(flags);
+
+	account(-(long)(n * cached));
+
+	return c;
+}
+
+static int tcache_free(struct chunk *self)
+{
+	struct tcache_bin *b;
+	struct chunk *flush = 0, *c, *next;
+	unsigned long flags;
+	size_t k;
+	int i = tcache_index(CHUNK_SIZE(self));
+
+	if (i >= TCACHE_BINS || !percpu_is_initialized()) return 0;
+
+	/* Crash on corrupted footer (likely from buffer overflow) */
+	if (NEXT_CHUNK(self)->psize != self->csize) panic("free: corrupted footer");
+
+	account(-(long)CHUNK_SIZE(self));
+
+	flags = irq_save_and_disable();
+	b = &tcache_get()->bins[i];
+	self->next = b->head;
+	b->head = self;
+	b->count++;
+
+	/* Too many cached chunks; detach the oldest batch and give it
+	 * back to the shared bins. */
+	if (b->count > TCACHE_MAX) {
+		c = b->head;
+		for (k = 1; k < TCACHE_MAX - TCACHE_FILL; k++)
+			c = c->next;
+		flush = c->next;
+		c->next = 0;
+		b->count = TCACHE_MAX - TCACHE_FILL;
+	}
+	irq_restore(flags);
+
+	/* These left the in-use count when they were cached, and binning
+	 * them takes them off again */
+	for (c = flush; c; c = next) {
+		next = c->next;
+		account(CHUNK_SIZE(c));
+		__bin_chunk(c);
+	}
+
+	return 1;
+}
+
+void *malloc(size_t n)
+{
+	size_t orig_size = n;
+	(void) orig_size;
+	struct chunk *c;
+
+	if (adjust_size(&n) < 0) return 0;
+
+	if (n > MMAP_THRESHOLD) {
+		panic("malloc: Allocation too big.");
+	}
+
+	if (!(c = tcache_alloc(n)) && !(c = malloc_chunk(n)))
+		return 0;
+
 #ifdef CONFIG_KASAN
 	kasan_set_state(CHUNK_TO_MEM(c), orig_size, 0);
 #endif
@@ -366,6 +547,7 @@ void *realloc(void *p, size_t n)
 	 * a waste of time even if we fail to get enough space, because our
 	 * subsequent call to free would otherwise have to do the merge. */
 	if (n > n1 && alloc_fwd(next)) {
+		account(CHUNK_SIZE(next));
 		n1 += CHUNK_SIZE(next);
 		next = NEXT_CHUNK(next);
 	}
@@ -409,16 +591,77 @@ void free(void *p)
 		return;
 
 	struct chunk *self = MEM_TO_CHUNK(p);
+
+	if (tcache_free(self)) {
+#ifdef CONFIG_KASAN
+		kasan_set_state(p, CHUNK_SIZE(self) - OVERHEAD, 1);
+#endif
+		return;
+	}
+
 	return __bin_chunk(self);
 }
 
+static void bin_chunk(struct chunk *self, int may_trim);
+
+/* Gives the top of the heap back to the page allocator if the free chunk
+ * that ends it is big enough. */
+static void trim_heap_top(void)
+{
+	struct chunk *w, *c;
+	size_t size, release;
+	int pending = 0;
+
+	lock(&heap_lock);
+
+	w = MEM_TO_CHUNK(heap_end);
+	if (!alloc_rev(w)) {
+		unlock(&heap_lock);
+		return;
+	}
+
+	c = PREV_CHUNK(w);
+	size = CHUNK_SIZE(c);
+
+	release = size > TRIM_THRESHOLD + TRIM_PAD ? (size - TRIM_PAD) & -PAGE_SIZE : 0;
+
+	if (release && __heap_trim(release, &pending) == 0) {
+		size -= release;
+		heap_end = (char *)heap_end - release;
+
+		/* New end-of-heap sentinel */
+		w = MEM_TO_CHUNK(heap_end);
+		w->psize = size | C_INUSE;
+		w->csize = 0 | C_INUSE;
+		c->csize = size | C_INUSE;
+	}
+
+	/* bin_chunk uncounts the chunk at its trimmed size */
+	account(size);
+
+	unlock(&heap_lock);
+
+	bin_chunk(c, 0);
+
+	if (pending)
+		__heap_trim_finish();
+}
+
 void __bin_chunk(struct chunk *self)
+{
+	bin_chunk(self, 1);
+}
+
+static void bin_chunk(struct chunk *self, int may_trim)
 {
 	struct chunk *next;
 	size_t final_size, new_size, size;
 	int reclaim=0;
+	int at_heap_top;
 	int i;
 
+	account(-(long)CHUNK_SIZE(self));
+
 	final_size = new_size = CHUNK_SIZE(self);
 	size_t kasan_size = CHUNK_SIZE(self) - OVERHEAD;
 	(void) kasan_size;
@@ -463,6 +706,10 @@ void __bin_chunk(struct chunk *self)
 
 	self->csize = final_size;
 	next->psize = final_size;
+	/* A zero-sized next chunk is the end-of-heap sentinel. Look now: once
+	 * the bin is unlocked, someone else can take this chunk and trim the
+	 * heap, sentinel and all. */
+	at_heap_top = !CHUNK_SIZE(next);
 	unlock(&mal.free_lock);
 
 	self->next = BIN_TO_CHUNK(i);
@@ -480,4 +727,7 @@ void __bin_chunk(struct chunk *self)
 	kasan_set_state(CHUNK_TO_MEM(self), kasan_size, 1);
 #endif
 	unlock_bin(i);
+
+	if (may_trim && at_heap_top && final_size > TRIM_THRESHOLD + TRIM_PAD)
+		trim_heap_top();
 }
\ No newline at end of file
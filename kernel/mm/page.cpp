@@ -15,90 +15,58 @@
 #include <carbon/vm.h>
 #include <carbon/memory.h>
 #include <carbon/bootprotocol.h>
-#include <carbon/fnv.h>
+#include <carbon/panic.h>
 
-#define PAGE_HASHTABLE_ENTRIES 0x4000
+/* struct pages live in a virtually flat array indexed by pfn, split into
+ * sections so holes in the physical address space don't cost anything */
+struct page **page_sections = NULL;
+unsigned long page_nr_sections = 0;
 
-struct page_hashtable
+void *efi_allocate_early_boot_mem(size_t size);
+
+void page_sections_init(unsigned long max_pfn)
 {
-	struct page *table[PAGE_HASHTABLE_ENTRIES];
-	struct page *tail[PAGE_HASHTABLE_ENTRIES];
-};
+	page_nr_sections = (max_pfn >> PAGE_SECTION_SHIFT) + 1;
 
-static struct page_hashtable hashtable = {};
-static size_t num_pages = 0;
+	size_t size = page_nr_sections * sizeof(struct page *);
+	void *ptr = efi_allocate_early_boot_mem(size);
+	if(!ptr)
+		panic("page: could not allocate the section table");
 
-unsigned int page_hash(uintptr_t p)
-{
-	unsigned int hash = fnv_hash(&p, sizeof(uintptr_t));
-	return hash % PAGE_HASHTABLE_ENTRIES;
+	page_sections = (struct page **) phys_to_virt(ptr);
+	memset(page_sections, 0, size);
 }
 
-static void append_to_hash(unsigned int hash, struct page *page)
+/* Makes sure every page in [base, base + size) has a struct page */
+void page_sections_populate(uintptr_t base, size_t size)
 {
-	if(!hashtable.table[hash])
-	{
-		hashtable.table[hash] = hashtable.tail[hash] = page;
-	}
-	else
-	{
-		hashtable.tail[hash]->next = page;
-		hashtable.tail[hash] = page;
-	}
-}
+	unsigned long start = base >> PAGE_SHIFT;
+	unsigned long end = (base + size + PAGE_SIZE - 1) >> PAGE_SHIFT;
 
-struct page *page_add_page(void *paddr)
-{
-	static size_t counter = 0;
-	counter++;
-	unsigned int hash = page_hash((uintptr_t) paddr);
-	struct page *page = (struct page *) __ksbrk(sizeof(struct page));
+	for(unsigned long pfn = start; pfn < end; pfn = (pfn | (PAGES_PER_SECTION - 1)) + 1)
+	{
+		unsigned long section = pfn >> PAGE_SECTION_SHIFT;
+		assert(section < page_nr_sections);
 
-	assert(page != NULL);
+		if(page_sections[section])
+			continue;
 
-	memset(page, 0, sizeof(*page));
+		void *ptr = efi_allocate_early_boot_mem(PAGES_PER_SECTION * sizeof(struct page));
+		if(!ptr)
+			panic("page: could not allocate a section's struct pages");
 
-	page->paddr = paddr;
-	page->ref = 0;
-	page->next = NULL;
-	page->next_un.next_allocation = NULL;
-	append_to_hash(hash, page);
-	++num_pages;
+		struct page *pages = (struct page *) phys_to_virt(ptr);
+		memset(pages, 0, PAGES_PER_SECTION * sizeof(struct page));
 
-	return page;
-}
+		uintptr_t paddr = section << (PAGE_SECTION_SHIFT + PAGE_SHIFT);
 
-void page_add_page_late(void *paddr)
-{
-	static size_t counter = 0;
-	counter++;
-	unsigned int hash = page_hash((uintptr_t) paddr);
-	struct page *page = (struct page *) zalloc(sizeof(struct page));
-
-	assert(page != NULL);
-
-	page->paddr = paddr;
-	page->ref = 0;
-	page->next = NULL;
-	append_to_hash(hash, page);
-	++num_pages;
-}
+		for(unsigned long i = 0; i < PAGES_PER_SECTION; i++, paddr += PAGE_SIZE)
+			pages[i].paddr = (void *) paddr;
 
-struct page *phys_to_page(uintptr_t phys)
-{
-	unsigned int hash = page_hash(phys);
-	struct page *p = hashtable.table[hash];
-	for(; p; p = p->next)
-	{
-		if(p->paddr == (void*) phys)
-			return p;
+		page_sections[section] = pages;
 	}
-
-	printf("page: %p queried for %lx, but it doesn't exist!\n", __builtin_return_address(0), phys);
-	return NULL;
 }
 
-
 bool klimits_present = false;
 
 uintptr_t get_kernel_base_address(void);
@@ -167,10 +135,15 @@ bool page_is_used(struct boot_info *info, void *__page)
 
 void page_print_shared(void)
 {
-	for(unsigned int i = 0; i < PAGE_HASHTABLE_ENTRIES; i++)
+	for(unsigned long i = 0; i < page_nr_sections; i++)
 	{
-		for(struct page *p = hashtable.table[i]; p != NULL; p = p->next)
+		struct page *section = page_sections[i];
+		if(!section)
+			continue;
+
+		for(unsigned long j = 0; j < PAGES_PER_SECTION; j++)
 		{
+			struct page *p = &section[j];
 			if(p->ref != 1 && p->ref != 0)
 				printf("Page %p has ref %lu\n", p->paddr, p->ref);
 		}
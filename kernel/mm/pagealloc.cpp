@@ -21,6 +21,9 @@
 #include <carbon/vm.h>
 #include <carbon/panic.h>
 #include <carbon/atomic.h>
+#include <carbon/percpu.h>
+#include <carbon/smp.h>
+#include <carbon/x86/eflags.h>
 
 size_t page_memory_size;
 size_t nr_global_pages;
@@ -33,48 +36,173 @@ static inline unsigned long pow2(int exp)
 	return (1UL << (unsigned long) exp);
 }
 
-struct page_list 
-{
-	struct page_list *prev;
-	struct page *page;
-	struct page_list *next;
-};
-
-struct page_cpu
-{
-	struct page_arena *arenas;
-	struct page_arena *arena_tail;
-	struct processor *cpu;
-	struct page_cpu *next;
-};
-
+/* Each arena covers one physical memory region and is managed by a binary
+ * buddy allocator: free blocks of 2^order pages are kept in per-order
+ * free lists, split on allocation and coalesced with their buddy on free.
+*/
 struct page_arena
 {
 	unsigned long free_pages;
 	unsigned long nr_pages;
-	void *start_arena;
-	void *end_arena;
-	struct page_list *page_list;
-	struct page_list *tail;
+	unsigned long start_pfn;
+	unsigned long end_pfn;
+	struct page *free_lists[PAGE_MAX_ORDER + 1];
 	Spinlock lock;
 	struct page_arena *next;
 };
 
+/* Per-cpu cache of order-0 pages. Recently freed (cache-hot) pages sit at
+ * the hot end and get handed out first; refills are added and drains are
+ * taken from the cold end. The cache is only touched with interrupts
+ * disabled on the owning cpu, so it needs no lock.
+*/
+struct page_cpu
+{
+	struct page *hot;
+	struct page *cold;
+	unsigned long nr_pages;
+};
+
+#define PAGE_CPU_BATCH		32
+#define PAGE_CPU_HIGH		(PAGE_CPU_BATCH * 4)
+
+PER_CPU_VAR(struct page_cpu page_cpu_cache) = {};
+
 static bool page_is_initialized = false;
 
-struct page_cpu main_cpu = {};
+static struct page_arena *arenas = NULL;
+static struct page_arena *arena_tail = NULL;
 
-#define for_every_arena(cpu)	for(struct page_arena *arena = (cpu)->arenas; arena; \
+#define for_every_arena()	for(struct page_arena *arena = arenas; arena; \
 	arena = arena->next)
 
+static inline unsigned long page_to_pfn(struct page *p)
+{
+	return (unsigned long) p->paddr >> PAGE_SHIFT;
+}
+
+static inline struct page *pfn_to_page(unsigned long pfn)
+{
+	return phys_to_page(pfn << PAGE_SHIFT);
+}
+
+static unsigned int pages_to_order(size_t nr_pages)
+{
+	unsigned int order = 0;
+
+	while(pow2(order) < nr_pages)
+		order++;
+
+	return order;
+}
+
+static void buddy_list_add(struct page_arena *arena, struct page *p, unsigned int order)
+{
+	struct page *head = arena->free_lists[order];
+
+	p->flags |= PAGE_FLAG_BUDDY;
+	p->order = order;
+	p->prev_free = NULL;
+	p->next_un.next_free = head;
+
+	if(head)
+		head->prev_free = p;
+
+	arena->free_lists[order] = p;
+}
+
+static void buddy_list_remove(struct page_arena *arena, struct page *p, unsigned int order)
+{
+	if(p->prev_free)
+		p->prev_free->next_un.next_free = p->next_un.next_free;
+	else
+		arena->free_lists[order] = p->next_un.next_free;
+
+	if(p->next_un.next_free)
+		p->next_un.next_free->prev_free = p->prev_free;
+
+	p->flags &= ~PAGE_FLAG_BUDDY;
+	p->prev_free = NULL;
+	p->next_un.next_free = NULL;
+}
+
+/* Frees a naturally aligned block of 2^order pages, merging it with its
+ * buddy for as long as the buddy is free as well. Called with the arena
+ * lock held.
+*/
+static void buddy_free_block(struct page_arena *arena, unsigned long pfn, unsigned int order)
+{
+	while(order < PAGE_MAX_ORDER)
+	{
+		unsigned long buddy_pfn = pfn ^ pow2(order);
+
+		if(buddy_pfn < arena->start_pfn || buddy_pfn + pow2(order) > arena->end_pfn)
+			break;
+
+		struct page *buddy = pfn_to_page(buddy_pfn);
+
+		if(!(buddy->flags & PAGE_FLAG_BUDDY) || buddy->order != order)
+			break;
+
+		buddy_list_remove(arena, buddy, order);
+
+		pfn &= ~pow2(order);
+		order++;
+	}
+
+	buddy_list_add(arena, pfn_to_page(pfn), order);
+}
+
+/* Gives back [pfn, end) to the arena as the largest aligned blocks that fit */
+static void buddy_free_range(struct page_arena *arena, unsigned long pfn, unsigned long end)
+{
+	while(pfn < end)
+	{
+		unsigned int order = 0;
+
+		while(order < PAGE_MAX_ORDER && !(pfn & pow2(order)) &&
+		      pfn + pow2(order + 1) <= end)
+			order++;
+
+		buddy_free_block(arena, pfn, order);
+		arena->free_pages += pow2(order);
+		pfn += pow2(order);
+	}
+}
+
+static struct page *buddy_alloc_block(struct page_arena *arena, unsigned int order)
+{
+	unsigned int i = order;
+
+	while(i <= PAGE_MAX_ORDER && !arena->free_lists[i])
+		i++;
+
+	if(i > PAGE_MAX_ORDER)
+		return NULL;
+
+	struct page *block = arena->free_lists[i];
+	buddy_list_remove(arena, block, i);
+
+	unsigned long pfn = page_to_pfn(block);
+
+	/* Split the block, giving the upper halves back to the lower orders */
+	while(i > order)
+	{
+		i--;
+		buddy_list_add(arena, pfn_to_page(pfn + pow2(i)), i);
+	}
+
+	arena->free_pages -= pow2(order);
+
+	return block;
+}
 
 struct page *page_alloc_from_arena(size_t nr_pages, unsigned long flags, struct page_arena *arena)
 {
-	struct page_list *p = arena->page_list;
-	size_t found_pages = 0;
-	uintptr_t base = 0;
-	struct page_list *base_pg = NULL;
-	bool found_base = false;
+	unsigned int order = pages_to_order(nr_pages);
+
+	if(order > PAGE_MAX_ORDER)
+		return NULL;
 
 	scoped_spinlock lock(&arena->lock);
 
@@ -83,227 +211,303 @@ struct page *page_alloc_from_arena(size_t nr_pages, unsigned long flags, struct
 		return NULL;
 	}
 
-	/* Look for contiguous pages */
-	for(; p && found_pages != nr_pages; p = p->next)
+	struct page *block = buddy_alloc_block(arena, order);
+	if(!block)
+		return NULL;
+
+	unsigned long pfn = page_to_pfn(block);
+
+	/* Trim the block down to what was asked for */
+	if(nr_pages != pow2(order))
+		buddy_free_range(arena, pfn + nr_pages, pfn + pow2(order));
+
+	lock.unlock();
+
+	struct page *plist = NULL;
+
+	for(size_t i = 0; i < nr_pages; i++)
 	{
-		if((uintptr_t) p->next - (uintptr_t) p > PAGE_SIZE && nr_pages != 1)
-		{
-			found_pages = 0;
-			found_base = false;
-			break;
-		}
-		else
-		{
-			if(found_base == false)
-			{
-				base = (uintptr_t) p;
-				found_base = true;
-			}
-			++found_pages;
-		}
+		struct page *p = i == 0 ? block : pfn_to_page(pfn + i);
+
+		assert(p->ref == 0);
+		page_ref(p);
+		p->next_un.next_allocation = NULL;
+
+		if(plist)
+			plist->next_un.next_allocation = p;
+		plist = p;
 	}
 
-	/* If we haven't found nr_pages contiguous pages, continue the search */
-	if(found_pages != nr_pages)
+	return block;
+}
+
+static struct page_arena *page_to_arena(struct page *p)
+{
+	unsigned long pfn = page_to_pfn(p);
+
+	for_every_arena()
 	{
-		return NULL;
+		if(arena->start_pfn <= pfn && arena->end_pfn > pfn)
+			return arena;
 	}
+
+	return NULL;
+}
+
+static void page_cpu_add_hot(struct page_cpu *pcp, struct page *p)
+{
+	p->prev_free = NULL;
+	p->next_un.next_free = pcp->hot;
+
+	if(pcp->hot)
+		pcp->hot->prev_free = p;
 	else
-	{
-		base_pg = (struct page_list *) base;
-		struct page_list *head = base_pg->prev;
-		struct page_list *tail = base_pg;
+		pcp->cold = p;
 
-		arena->free_pages -= found_pages;
+	pcp->hot = p;
+	pcp->nr_pages++;
+}
 
-		while(found_pages--)
-			tail = tail->next;
+static void page_cpu_add_cold(struct page_cpu *pcp, struct page *p)
+{
+	p->next_un.next_free = NULL;
+	p->prev_free = pcp->cold;
 
-		if(head)
-			head->next = tail;
-		else
-			arena->page_list = tail;
-		
-		if(tail)
-			tail->prev = head;
+	if(pcp->cold)
+		pcp->cold->next_un.next_free = p;
+	else
+		pcp->hot = p;
 
-		lock.unlock();
+	pcp->cold = p;
+	pcp->nr_pages++;
+}
 
-		struct page *plist = NULL;
-		struct page_list *pl = base_pg;
-	
-		for(size_t i = 0; i < nr_pages; i++)
-		{
-			assert(pl->page->ref == 0);
-			page_ref(pl->page);
-
-			if(!plist)
-			{
-				plist = pl->page;
-			}
-			else
-			{
-				plist->next_un.next_allocation = pl->page;
-				plist = pl->page;
-			}
-
-			pl = pl->next;
-		}
+static struct page *page_cpu_take_hot(struct page_cpu *pcp)
+{
+	struct page *p = pcp->hot;
+	if(!p)
+		return NULL;
 
-		return base_pg->page;
-	}
+	pcp->hot = p->next_un.next_free;
+
+	if(pcp->hot)
+		pcp->hot->prev_free = NULL;
+	else
+		pcp->cold = NULL;
+
+	pcp->nr_pages--;
+	p->next_un.next_free = NULL;
+
+	return p;
 }
 
-struct page *page_alloc(size_t nr_pages, unsigned long flags)
+static struct page *page_cpu_take_cold(struct page_cpu *pcp)
 {
-	struct page *pages = NULL;
-	for_every_arena(&main_cpu)
+	struct page *p = pcp->cold;
+	if(!p)
+		return NULL;
+
+	pcp->cold = p->prev_free;
+
+	if(pcp->cold)
+		pcp->cold->next_un.next_free = NULL;
+	else
+		pcp->hot = NULL;
+
+	pcp->nr_pages--;
+	p->prev_free = NULL;
+
+	return p;
+}
+
+/* Grabs up to PAGE_CPU_BATCH pages from the buddy allocator, taking each
+ * arena lock once per batch instead of once per page.
+*/
+static void page_cpu_refill(struct page_cpu *pcp)
+{
+	size_t got = 0;
+
+	for_every_arena()
 	{
 		if(arena->free_pages == 0)
 			continue;
-		if((pages = page_alloc_from_arena(nr_pages, flags, arena)) != NULL)
+
+		scoped_spinlock lock(&arena->lock);
+
+		while(got < PAGE_CPU_BATCH)
 		{
-			used_pages.add_fetch(nr_pages);
-			return pages;
+			struct page *p = buddy_alloc_block(arena, 0);
+			if(!p)
+				break;
+
+			page_cpu_add_cold(pcp, p);
+			got++;
 		}
+
+		if(got == PAGE_CPU_BATCH)
+			break;
 	}
 
-	return NULL;
+	if(got)
+		used_pages.add_fetch(got);
 }
 
-static void append_page(struct page_arena *arena, struct page_list *page)
+/* Gives nr cold pages back to the buddy allocator */
+static void page_cpu_drain(struct page_cpu *pcp, size_t nr)
 {
-	if(!arena->page_list)
-	{
-		arena->page_list = arena->tail = page;
-		page->next = NULL;
-		page->prev = NULL;
-	}
-	else
+	struct page_arena *locked = NULL;
+	size_t drained = 0;
+
+	for(; drained < nr; drained++)
 	{
-		arena->tail->next = page;
-		page->prev = arena->tail;
-		arena->tail = page;
-		page->next = NULL;
+		struct page *p = page_cpu_take_cold(pcp);
+		if(!p)
+			break;
+
+		struct page_arena *arena = page_to_arena(p);
+		assert(arena != NULL);
+
+		if(arena != locked)
+		{
+			if(locked)
+				locked->lock.Unlock();
+			arena->lock.Lock();
+			locked = arena;
+		}
+
+		unsigned long pfn = page_to_pfn(p);
+		buddy_free_range(arena, pfn, pfn + 1);
 	}
+
+	if(locked)
+		locked->lock.Unlock();
+
+	if(drained)
+		used_pages.sub_fetch(drained);
 }
 
-void page_free_pages(struct page_arena *arena, void *addr, size_t nr_pages)
+static struct page *page_cpu_alloc(void)
 {
-	scoped_spinlock lock(&arena->lock);
+	unsigned long flags = irq_save_and_disable();
 
-	if(!arena->page_list)
-	{
-		struct page_list *list = NULL;
-		uintptr_t b = (uintptr_t) addr;
-		for(size_t i = 0; i < nr_pages; i++, b += PAGE_SIZE)
-		{
-			struct page_list *l = (struct page_list *) phys_to_virt(b);
-			l->page = phys_to_page(b);
-			l->next = NULL;
-			if(!list)
-			{
-				arena->page_list = l;
-				l->prev = NULL;
-				list = l;	
-			}
-			else
-			{
-				list->next = l;
-				l->prev = list;
-				list = l;
-			}
+	struct page_cpu *pcp = get_per_cpu_ptr(page_cpu_cache);
 
-		}
-	}
-	else
+	if(!pcp->hot)
+		page_cpu_refill(pcp);
+
+	struct page *p = page_cpu_take_hot(pcp);
+
+	irq_restore(flags);
+
+	if(!p)
+		return NULL;
+
+	assert(p->ref == 0);
+	page_ref(p);
+
+	return p;
+}
+
+static void page_cpu_free(struct page *p)
+{
+	unsigned long flags = irq_save_and_disable();
+
+	struct page_cpu *pcp = get_per_cpu_ptr(page_cpu_cache);
+
+	page_cpu_add_hot(pcp, p);
+
+	if(pcp->nr_pages > PAGE_CPU_HIGH)
+		page_cpu_drain(pcp, PAGE_CPU_BATCH);
+
+	irq_restore(flags);
+}
+
+struct page *page_alloc(size_t nr_pages, unsigned long flags)
+{
+	if(nr_pages == 1 && Percpu::percpu_initialized())
+		return page_cpu_alloc();
+
+	struct page *pages = NULL;
+	for_every_arena()
 	{
-		struct page_list *list = arena->page_list;
-		while(list->next) list = list->next;
-		
-		uintptr_t b = (uintptr_t) addr;
-		for(size_t i = 0; i < nr_pages; i++, b += PAGE_SIZE)
+		if(arena->free_pages < nr_pages)
+			continue;
+		if((pages = page_alloc_from_arena(nr_pages, flags, arena)) != NULL)
 		{
-			struct page_list *l = (struct page_list *) phys_to_virt(b);
-			l->page = phys_to_page(b);
-			l->next = NULL;
-			list->next = l;
-			l->prev = list;
-			list = l;
+			used_pages.add_fetch(nr_pages);
+			return pages;
 		}
 	}
+
+	return NULL;
 }
 
 void page_free(size_t nr_pages, void *addr)
 {
-	/* printk("Freeing %p\n", addr); */
-	for_every_arena(&main_cpu)
+	unsigned long pfn = (unsigned long) addr >> PAGE_SHIFT;
+
+	if(nr_pages == 1 && Percpu::percpu_initialized())
 	{
-		if((uintptr_t) arena->start_arena <= (uintptr_t) addr && 
-			(uintptr_t) arena->end_arena > (uintptr_t) addr)
+		page_cpu_free(phys_to_page((uintptr_t) addr));
+		return;
+	}
+
+	for_every_arena()
+	{
+		if(arena->start_pfn <= pfn && arena->end_pfn > pfn)
 		{
-			page_free_pages(arena, addr, nr_pages);
+			scoped_spinlock lock(&arena->lock);
+
+			buddy_free_range(arena, pfn, pfn + nr_pages);
 			used_pages.sub_fetch(nr_pages);
+			return;
 		}
 	}
 }
 
 size_t page_add_counter = 0;
 
-static int page_add(struct page_arena *arena, void *__page,
-	struct boot_info *info)
-{
-	if(page_is_used(info, __page))
-		return -1;
-	page_add_counter++;
-
-	struct page_list *page = (struct page_list *) phys_to_virt(__page);
-	page->next = NULL;
-
-	append_page(arena, page);
-	page->page = page_add_page(__page);
-
-	return 0;
-}
-
-static void append_arena(struct page_cpu *cpu, struct page_arena *arena)
+static void append_arena(struct page_arena *arena)
 {
-	if(!cpu->arenas)
+	if(!arenas)
 	{
-		cpu->arenas = cpu->arena_tail = arena;
+		arenas = arena_tail = arena;
 	}
 	else
 	{
-		cpu->arena_tail->next = arena;
-		cpu->arena_tail = arena;
+		arena_tail->next = arena;
+		arena_tail = arena;
 	}
 }
 
 static void page_add_region(uintptr_t base, size_t size, struct boot_info *info)
 {
-	while(size)
-	{
-		size_t area_size = min(size, 0x200000);
-		struct page_arena *arena = (struct page_arena *) __ksbrk(sizeof(struct page_arena));
-		assert(arena != NULL);
-		memset_s(arena, 0, sizeof(struct page_arena));
+	struct page_arena *arena = (struct page_arena *) __ksbrk(sizeof(struct page_arena));
+	assert(arena != NULL);
+	memset_s(arena, 0, sizeof(struct page_arena));
 
-		arena->free_pages = arena->nr_pages = area_size >> PAGE_SHIFT;
-		arena->start_arena = (void*) base;
-		arena->end_arena = (void*) (base + area_size);
+	arena->nr_pages = size >> PAGE_SHIFT;
+	arena->start_pfn = base >> PAGE_SHIFT;
+	arena->end_pfn = arena->start_pfn + arena->nr_pages;
 
-		for(size_t i = 0; i < area_size; i += PAGE_SIZE)
+	/* Hand runs of unused pages to the buddy allocator */
+	unsigned long run_start = arena->start_pfn;
+
+	for(unsigned long pfn = arena->start_pfn; pfn < arena->end_pfn; pfn++)
+	{
+		if(!page_is_used(info, (void *) (pfn << PAGE_SHIFT)))
 		{
-			/* If the page is being used, decrement the free_pages counter */
-			if(page_add(arena, (void*) (base + i), info) < 0)
-				arena->free_pages--;
+			page_add_counter++;
+			continue;
 		}
 
-		append_arena(&main_cpu, arena);
-
-		size -= area_size;
-		base += area_size;
+		buddy_free_range(arena, run_start, pfn);
+		run_start = pfn + 1;
 	}
+
+	buddy_free_range(arena, run_start, arena->end_pfn);
+
+	append_arena(arena);
 }
 
 void *efi_allocate_early_boot_mem(size_t size);
@@ -319,14 +523,21 @@ void page_init(size_t memory_size, void *(*get_phys_mem_region)(uintptr_t *base,
 	page_memory_size = memory_size;
 	nr_global_pages = size_to_pages(memory_size);
 
-	size_t nr_arenas = page_memory_size / 0x200000;
-	if(page_memory_size % 0x200000)
+	/* First pass: find out how many regions there are and where physical
+	 * memory ends, so we can size the arenas and the section table.
+	*/
+	size_t nr_arenas = 0;
+	unsigned long max_pfn = 0;
+
+	while((context_cookie = get_phys_mem_region(&region_base,
+		&region_size, context_cookie)) != NULL)
+	{
 		nr_arenas++;
+		if((region_base + region_size) >> PAGE_SHIFT > max_pfn)
+			max_pfn = (region_base + region_size) >> PAGE_SHIFT;
+	}
 
-	size_t needed_memory = nr_arenas *
-		sizeof(struct page_arena) + 
-		nr_global_pages * sizeof(struct page);
-	void *ptr = efi_allocate_early_boot_mem(needed_memory);
+	void *ptr = efi_allocate_early_boot_mem(nr_arenas * sizeof(struct page_arena));
 	if(!ptr)
 	{
 		panic("Failure on page_init");
@@ -334,6 +545,18 @@ void page_init(size_t memory_size, void *(*get_phys_mem_region)(uintptr_t *base,
 
 	__kbrk(phys_to_virt(ptr));
 
+	page_sections_init(max_pfn);
+
+	/* Second pass: allocate struct pages for every section that has memory.
+	 * Allocating early boot memory can only shrink the regions, so
+	 * everything the third pass sees is covered.
+	*/
+	while((context_cookie = get_phys_mem_region(&region_base,
+		&region_size, context_cookie)) != NULL)
+	{
+		page_sections_populate(region_base, region_size);
+	}
+
 	/* The context cookie is supposed to be used as a way for the
 	 * get_phys_mem_region implementation to keep track of where it's at,
 	 * without needing ugly global variables.
@@ -346,6 +569,9 @@ void page_init(size_t memory_size, void *(*get_phys_mem_region)(uintptr_t *base,
 	while((context_cookie = get_phys_mem_region(&region_base,
 		&region_size, context_cookie)) != NULL)
 	{
+		printf("page: Free region %016lx-%016lx\n", region_base,
+		       region_base + region_size);
+
 		/* page_add_region can't return an error value since it halts
 		 * on failure
 		*/
@@ -401,14 +627,124 @@ inline struct page *alloc_pages_nozero(size_t nr_pgs, unsigned long flags)
 	return page_alloc(nr_pgs, flags);
 }
 
+/* Pool of pages that were zeroed ahead of time by the idle threads.
+ * Pages in the pool are allocated (ref == 1) and linked through next_free.
+*/
+#define PAGE_ZERO_POOL_TARGET		256
+
+static struct page *zero_pool = NULL;
+static size_t zero_pool_pages = 0;
+static Spinlock zero_pool_lock;
+static atomic<size_t> zero_pool_hits{0};
+static atomic<size_t> zero_pool_misses{0};
+
+/* Zeroes a page with non-temporal stores, so we don't evict the cache
+ * of whatever ends up running after the idle thread
+*/
+static void page_zero_nontemporal(void *page)
+{
+	unsigned long *p = (unsigned long *) page;
+
+	for(size_t i = 0; i < PAGE_SIZE / sizeof(unsigned long); i += 4)
+	{
+		__asm__ __volatile__("movnti %4, %0\n\t"
+				     "movnti %4, %1\n\t"
+				     "movnti %4, %2\n\t"
+				     "movnti %4, %3"
+				     : "=m"(p[i]), "=m"(p[i + 1]), "=m"(p[i + 2]),
+				       "=m"(p[i + 3])
+				     : "r"(0UL));
+	}
+
+	__asm__ __volatile__("sfence" ::: "memory");
+}
+
+static struct page *page_zero_pool_take(void)
+{
+	if(zero_pool_pages == 0)
+		return NULL;
+
+	scoped_spinlock_irqsave lock(&zero_pool_lock);
+
+	struct page *p = zero_pool;
+	if(!p)
+		return NULL;
+
+	zero_pool = p->next_un.next_free;
+	zero_pool_pages--;
+	p->next_un.next_allocation = NULL;
+
+	return p;
+}
+
+/* Gives every page in the zero pool back to the buddy allocator, so they
+ * can coalesce into contiguous blocks again. Returns the number of pages. */
+static size_t page_zero_pool_drain(void)
+{
+	struct page *list;
+	size_t nr;
+
+	{
+		scoped_spinlock_irqsave lock(&zero_pool_lock);
+
+		list = zero_pool;
+		nr = zero_pool_pages;
+		zero_pool = NULL;
+		zero_pool_pages = 0;
+	}
+
+	/* Straight to the buddy allocator; free_page() would only move them
+	 * to this cpu's cache */
+	while(list)
+	{
+		struct page *next = list->next_un.next_free;
+		struct page_arena *arena = page_to_arena(list);
+		unsigned long pfn = page_to_pfn(list);
+
+		assert(arena != NULL);
+
+		page_unref(list);
+		list->next_un.next_allocation = NULL;
+
+		arena->lock.Lock();
+		buddy_free_range(arena, pfn, pfn + 1);
+		arena->lock.Unlock();
+
+		used_pages.sub_fetch(1);
+		list = next;
+	}
+
+	return nr;
+}
+
 struct page *__get_phys_pages(size_t nr_pgs, unsigned long flags)
 {
 	struct page *plist = NULL;
+	struct page *tail = NULL;
 	size_t off = 0;
 
 	for(size_t i = 0; i < nr_pgs; i++, off += PAGE_SIZE)
 	{
-		struct page *p = alloc_pages_nozero(1, flags);
+		struct page *p = NULL;
+		bool zero = page_should_zero(flags);
+
+		if(zero && (p = page_zero_pool_take()) != NULL)
+		{
+			zero_pool_hits.add_fetch(1);
+			zero = false;
+		}
+		else
+		{
+			p = alloc_pages_nozero(1, flags);
+
+			if(zero)
+				zero_pool_misses.add_fetch(1);
+
+			/* Don't fail with zeroed pages still parked in the
+			 * pool; they do for anyone */
+			if(!p && (p = page_zero_pool_take()) != NULL)
+				zero = false;
+		}
 
 		if(!p)
 		{
@@ -420,21 +756,17 @@ struct page *__get_phys_pages(size_t nr_pgs, unsigned long flags)
 
 		p->off = off;
 
-		if(page_should_zero(flags))
+		if(zero)
 		{
 			memset(phys_to_virt(p->paddr), 0, PAGE_SIZE);
 		}
 
 		if(!plist)
-		{
 			plist = p;
-		}
 		else
-		{
-			struct page *i = plist;
-			for(; i->next_un.next_allocation != NULL; i = i->next_un.next_allocation);
-			i->next_un.next_allocation = p;
-		}
+			tail->next_un.next_allocation = p;
+
+		tail = p;
 	}
 
 	return plist;
@@ -443,6 +775,11 @@ struct page *__get_phys_pages(size_t nr_pgs, unsigned long flags)
 struct page *do_alloc_pages_contiguous(size_t nr_pgs, unsigned long flags)
 {
 	struct page *p = alloc_pages_nozero(nr_pgs, flags);
+
+	/* The pool's pages may be what's keeping a block from coalescing */
+	if(!p && page_zero_pool_drain())
+		p = alloc_pages_nozero(nr_pgs, flags);
+
 	if(!p)
 		return NULL;
 	
@@ -467,8 +804,44 @@ namespace Page
 
 void GetStats(struct page_usage *usage)
 {
+	/* used_pages counts everything outside the buddy allocator, which
+	 * includes the pages sitting in the per-cpu caches */
+	size_t cached = 0;
+
+	if(Percpu::percpu_initialized())
+	{
+		for(unsigned long i = 0; i < Percpu::nr_bases; i++)
+			cached += other_cpu_get_ptr(page_cpu_cache, i)->nr_pages;
+	}
+
 	usage->total_pages = nr_global_pages;
-	usage->used_pages = used_pages;
+	usage->used_pages = used_pages - cached - zero_pool_pages;
+	usage->zero_pool_pages = zero_pool_pages;
+	usage->zero_pool_hits = zero_pool_hits;
+	usage->zero_pool_misses = zero_pool_misses;
+}
+
+/* Called by the idle threads; zeroes one page for the zero pool.
+ * Returns false once there's nothing left to do.
+*/
+bool ZeroPoolWork()
+{
+	if(zero_pool_pages >= PAGE_ZERO_POOL_TARGET)
+		return false;
+
+	struct page *p = alloc_pages_nozero(1, PAGE_ALLOC_NOZERO);
+	if(!p)
+		return false;
+
+	page_zero_nontemporal(phys_to_virt(p->paddr));
+
+	scoped_spinlock_irqsave lock(&zero_pool_lock);
+
+	p->next_un.next_free = zero_pool;
+	zero_pool = p;
+	zero_pool_pages++;
+
+	return true;
 }
 
 };
\ No newline at end of file
@@ -0,0 +1,344 @@
+/*
+* Copyright (c) 2019 Pedro Falcato
+* This file is part of Carbon, and is released under the terms of the MIT License
+* check LICENSE at the root directory for more information
+*/
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <carbon/slab.h>
+#include <carbon/page.h>
+#include <carbon/memory.h>
+#include <carbon/percpu.h>
+#include <carbon/smp.h>
+#include <carbon/x86/eflags.h>
+
+struct slab
+{
+	struct slab_cache *cache;
+	struct page *pages;
+	void *free_list;
+	size_t in_use;
+	struct slab *prev;
+	struct slab *next;
+};
+
+static_assert(sizeof(struct slab) <= SLAB_HEADER_SIZE, "struct slab doesn't fit in its header");
+
+static inline void *&slab_obj_link(struct slab_cache *cache, void *obj)
+{
+	return *(void **) ((char *) obj + cache->free_off);
+}
+
+static void slab_list_add(struct slab **list, struct slab *s)
+{
+	s->prev = nullptr;
+	s->next = *list;
+
+	if(*list)
+		(*list)->prev = s;
+
+	*list = s;
+}
+
+static void slab_list_remove(struct slab **list, struct slab *s)
+{
+	if(s->prev)
+		s->prev->next = s->next;
+	else
+		*list = s->next;
+
+	if(s->next)
+		s->next->prev = s->prev;
+
+	s->prev = s->next = nullptr;
+}
+
+static struct slab *slab_create_slab(struct slab_cache *cache)
+{
+	struct page *pages = alloc_pages(cache->slab_pages,
+					 PAGE_ALLOC_CONTIGUOUS | PAGE_ALLOC_NOZERO);
+	if(!pages)
+		return nullptr;
+
+	char *base = (char *) phys_to_virt(pages->paddr);
+	struct slab *s = (struct slab *) base;
+
+	s->cache = cache;
+	s->pages = pages;
+	s->in_use = 0;
+	s->free_list = nullptr;
+	s->prev = s->next = nullptr;
+
+	for(struct page *p = pages; p; p = p->next_un.next_allocation)
+		p->misc_data.misc = s;
+
+	/* Build the freelist backwards so objects get handed out in
+	 * address order */
+	char *obj = base + cache->first_obj_off + (cache->objs_per_slab - 1) * cache->slot_size;
+
+	for(size_t i = 0; i < cache->objs_per_slab; i++, obj -= cache->slot_size)
+	{
+		if(cache->ctor)
+			cache->ctor(obj);
+
+		slab_obj_link(cache, obj) = s->free_list;
+		s->free_list = obj;
+	}
+
+	return s;
+}
+
+static inline struct slab *slab_from_object(void *obj)
+{
+	struct page *p = phys_to_page((uintptr_t) obj - PHYS_BASE);
+	assert(p != nullptr);
+
+	return (struct slab *) p->misc_data.misc;
+}
+
+/* Takes up to nr objects out of the slabs. Called with the cache lock held. */
+static size_t slab_get_objects(struct slab_cache *cache, void **objs, size_t nr)
+{
+	size_t got = 0;
+
+	while(got < nr)
+	{
+		struct slab *s = cache->partial;
+
+		if(!s)
+		{
+			if(cache->empty)
+			{
+				s = cache->empty;
+				slab_list_remove(&cache->empty, s);
+			}
+			else if(!(s = slab_create_slab(cache)))
+				break;
+
+			slab_list_add(&cache->partial, s);
+		}
+
+		while(got < nr && s->free_list)
+		{
+			void *obj = s->free_list;
+			s->free_list = slab_obj_link(cache, obj);
+			s->in_use++;
+			objs[got++] = obj;
+		}
+
+		if(!s->free_list)
+		{
+			slab_list_remove(&cache->partial, s);
+			slab_list_add(&cache->full, s);
+		}
+	}
+
+	return got;
+}
+
+/* Gives nr objects back to their slabs. Called with the cache lock held. */
+static void slab_put_objects(struct slab_cache *cache, void **objs, size_t nr)
+{
+	for(size_t i = 0; i < nr; i++)
+	{
+		void *obj = objs[i];
+		struct slab *s = slab_from_object(obj);
+
+		assert(s->cache == cache);
+
+		bool was_full = s->free_list == nullptr;
+
+		slab_obj_link(cache, obj) = s->free_list;
+		s->free_list = obj;
+		s->in_use--;
+
+		if(was_full)
+		{
+			slab_list_remove(&cache->full, s);
+			slab_list_add(&cache->partial, s);
+		}
+
+		if(s->in_use == 0)
+		{
+			slab_list_remove(&cache->partial, s);
+
+			/* Keep one empty slab around to absorb alloc/free
+			 * ping-pong, give the rest back */
+			if(!cache->empty)
+				slab_list_add(&cache->empty, s);
+			else
+				free_pages(s->pages);
+		}
+	}
+}
+
+/* Sets up the cache's magazines. Nothing gets allocated until the number of
+ * cpus is known; until then, allocations just take the cache lock. */
+static struct slab_magazine *slab_alloc_magazines(struct slab_cache *cache)
+{
+	unsigned int nr = Smp::GetNrCpus();
+	if(!nr)
+		return nullptr;
+
+	size_t size = nr * sizeof(struct slab_magazine);
+	struct slab_magazine *mags = (struct slab_magazine *)
+		aligned_alloc(SLAB_MAGAZINE_ALIGN, size);
+	if(!mags)
+		return nullptr;
+
+	memset(mags, 0, size);
+
+	cache->lock.Lock();
+
+	/* Another cpu might have beaten us to it */
+	if(cache->magazines)
+	{
+		cache->lock.Unlock();
+		free(mags);
+		return cache->magazines;
+	}
+
+	cache->nr_magazines = nr;
+	__atomic_store_n(&cache->magazines, mags, __ATOMIC_RELEASE);
+
+	cache->lock.Unlock();
+
+	return mags;
+}
+
+static struct slab_magazine *slab_get_magazine(struct slab_cache *cache)
+{
+	if(!Percpu::percpu_initialized())
+		return nullptr;
+
+	struct slab_magazine *mags = __atomic_load_n(&cache->magazines, __ATOMIC_ACQUIRE);
+
+	if(!mags && !(mags = slab_alloc_magazines(cache)))
+		return nullptr;
+
+	unsigned int cpu = get_cpu_nr();
+	assert(cpu < cache->nr_magazines);
+
+	return &mags[cpu];
+}
+
+void *slab_allocate(struct slab_cache *cache)
+{
+	void *obj = nullptr;
+	unsigned long flags = irq_save_and_disable();
+
+	struct slab_magazine *mag = slab_get_magazine(cache);
+
+	if(mag)
+	{
+		if(mag->nr_objs == 0)
+		{
+			/* Refill half of the magazine in one go */
+			cache->lock.Lock();
+			mag->nr_objs = slab_get_objects(cache, mag->objs,
+							SLAB_MAGAZINE_SIZE / 2 + 1);
+			cache->lock.Unlock();
+		}
+
+		if(mag->nr_objs)
+			obj = mag->objs[--mag->nr_objs];
+	}
+	else
+	{
+		cache->lock.Lock();
+		slab_get_objects(cache, &obj, 1);
+		cache->lock.Unlock();
+	}
+
+	irq_restore(flags);
+
+	return obj;
+}
+
+void slab_free(struct slab_cache *cache, void *addr)
+{
+	if(!addr)
+		return;
+
+	unsigned long flags = irq_save_and_disable();
+
+	struct slab_magazine *mag = slab_get_magazine(cache);
+
+	if(mag)
+	{
+		if(mag->nr_objs == SLAB_MAGAZINE_SIZE)
+		{
+			/* Flush the older half back to the slabs */
+			size_t nr = SLAB_MAGAZINE_SIZE / 2 + 1;
+
+			cache->lock.Lock();
+			slab_put_objects(cache, mag->objs, nr);
+			cache->lock.Unlock();
+
+			memmove(mag->objs, mag->objs + nr, (mag->nr_objs - nr) * sizeof(void *));
+			mag->nr_objs -= nr;
+		}
+
+		mag->objs[mag->nr_objs++] = addr;
+	}
+	else
+	{
+		cache->lock.Lock();
+		slab_put_objects(cache, &addr, 1);
+		cache->lock.Unlock();
+	}
+
+	irq_restore(flags);
+}
+
+struct slab_cache *slab_create(const char *name, size_t size, size_t alignment,
+	unsigned int flags, void (*ctor)(void *))
+{
+	if(alignment & (alignment - 1))
+		return nullptr;
+
+	return new slab_cache(name, size, alignment, flags, ctor);
+}
+
+static void slab_free_list(struct slab *list)
+{
+	struct slab *next = nullptr;
+
+	for(struct slab *s = list; s; s = next)
+	{
+		next = s->next;
+		free_pages(s->pages);
+	}
+}
+
+void slab_destroy(struct slab_cache *cache)
+{
+	unsigned long flags = irq_save_and_disable();
+
+	cache->lock.Lock();
+
+	for(unsigned int i = 0; i < cache->nr_magazines; i++)
+	{
+		struct slab_magazine *mag = &cache->magazines[i];
+
+		slab_put_objects(cache, mag->objs, mag->nr_objs);
+		mag->nr_objs = 0;
+	}
+
+	/* Every object must have been freed by now */
+	assert(cache->full == nullptr);
+	assert(cache->partial == nullptr);
+
+	slab_free_list(cache->empty);
+	cache->empty = nullptr;
+
+	cache->lock.Unlock();
+
+	irq_restore(flags);
+
+	free(cache->magazines);
+	delete cache;
+}
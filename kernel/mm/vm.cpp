@@ -10,6 +10,7 @@
 #include <errno.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <carbon/vm.h>
 #include <carbon/memory.h>
@@ -17,16 +18,23 @@
 #include <carbon/vmobject.h>
 #include <carbon/syscall_utils.h>
 #include <carbon/fs/file.h>
+#include <carbon/slab.h>
+#include <carbon/atomic.h>
+#include <carbon/mmu_gather.h>
 
 #include <carbon/public/vm.h>
 
 #include <libdict/dict.h>
+#include <libdict/rb_tree.h>
 
 #define KADDR_SPACE_SIZE	0x800000000000
 #define KADDR_START		0xffff800000000000
 
 struct address_space kernel_address_space = {};
 
+static slab_cache vm_region_cache{"vm_region", sizeof(struct vm_region),
+				  alignof(struct vm_region), 0, nullptr};
+
 int vm_cmp(const void* k1, const void* k2)
 {
 	if(k1 == k2)
@@ -35,33 +43,148 @@ int vm_cmp(const void* k1, const void* k2)
         return (unsigned long) k1 < (unsigned long) k2 ? -1 : 1; 
 }
 
+static inline size_t vm_gap(unsigned long start, unsigned long end)
+{
+	return end > start ? end - start : 0;
+}
+
+static void vm_region_augment(void *datum, void *left_datum, void *right_datum)
+{
+	struct vm_region *region = (struct vm_region *) datum;
+	struct vm_region *left = (struct vm_region *) left_datum;
+	struct vm_region *right = (struct vm_region *) right_datum;
+
+	/* Freshly inserted nodes don't have their region attached yet */
+	if(!region)
+		return;
+
+	unsigned long end = region->start + region->size;
+	size_t gap = 0;
+
+	region->subtree_start = region->start;
+	region->subtree_end = end;
+
+	if(left)
+	{
+		region->subtree_start = left->subtree_start;
+		gap = left->subtree_max_gap;
+
+		size_t g = vm_gap(left->subtree_end, region->start);
+		if(g > gap)
+			gap = g;
+	}
+
+	if(right)
+	{
+		region->subtree_end = right->subtree_end;
+
+		if(right->subtree_max_gap > gap)
+			gap = right->subtree_max_gap;
+
+		size_t g = vm_gap(end, right->subtree_start);
+		if(g > gap)
+			gap = g;
+	}
+
+	region->subtree_max_gap = gap;
+}
+
+struct rb_tree *vm_create_area_tree(void)
+{
+	struct rb_tree *tree = rb_tree_new(vm_cmp);
+
+	if(tree)
+		rb_tree_set_augment(tree, vm_region_augment);
+
+	return tree;
+}
+
+/* Re-summarise the path above a region whose start or size changed in place */
+static void vm_region_changed(struct address_space *as, struct vm_region *region)
+{
+	rb_tree_augment_update(as->area_tree, (const void *) region->start);
+}
+
 struct vm_region *vm_reserve_region(struct address_space *as,
 				    unsigned long start, size_t size)
 {
 	assert((start & (PAGE_SIZE-1)) == 0);
 	size = size_to_pages(size) << PAGE_SHIFT;
-	struct vm_region *region = (struct vm_region *) zalloc(sizeof(*region));
+	struct vm_region *region = (struct vm_region *) slab_allocate(&vm_region_cache);
 
 	if(!region)
 		return NULL;
 
+	memset(region, 0, sizeof(*region));
+
 	region->start = start;
 	region->size = size;
 	region->perms = 0;
+	region->as = as;
 
 	dict_insert_result res = rb_tree_insert(as->area_tree,
 						(void *) start);
 
 	if(res.inserted == false)
 	{
-		free(region);
+		slab_free(&vm_region_cache, region);
 		return NULL;
 	}
 
 	*res.datum_ptr = region;
+	vm_region_changed(as, region);
 
 	return region; 
 }
+
+/* Returns true and the lowest usable address in *out if [gap_start, gap_end)
+ * has room for size bytes at or above min */
+static inline bool vm_gap_fits(unsigned long gap_start, unsigned long gap_end,
+			       unsigned long min, size_t size, unsigned long *out)
+{
+	unsigned long start = gap_start < min ? min : gap_start;
+
+	if(vm_gap(start, gap_end) < size)
+		return false;
+
+	*out = start;
+	return true;
+}
+
+/* First-fit search over the holes that end inside node's subtree, prev_end
+ * being the end of whatever precedes the subtree. Subtrees whose biggest hole
+ * is too small, or that end below min, are skipped whole, so this only
+ * walks O(log n) nodes. */
+static bool vm_find_gap(rb_node *node, unsigned long prev_end, unsigned long min,
+			size_t size, unsigned long *out)
+{
+	if(!node)
+		return false;
+
+	struct vm_region *region = (struct vm_region *) rb_node_datum(node);
+
+	if(region->subtree_end <= min)
+		return false;
+
+	if(region->subtree_max_gap < size &&
+	   vm_gap(prev_end, region->subtree_start) < size)
+		return false;
+
+	rb_node *left = rb_node_left(node);
+
+	if(vm_find_gap(left, prev_end, min, size, out))
+		return true;
+
+	unsigned long before = left ?
+		((struct vm_region *) rb_node_datum(left))->subtree_end : prev_end;
+
+	if(vm_gap_fits(before, region->start, min, size, out))
+		return true;
+
+	return vm_find_gap(rb_node_right(node), region->start + region->size,
+			   min, size, out);
+}
+
 #define DEBUG_VM 0
 struct vm_region *vm_allocate_region(struct address_space *as,
 				     unsigned long min, size_t size)
@@ -69,68 +192,30 @@ struct vm_region *vm_allocate_region(struct address_space *as,
 	if(min < as->start)
 		min = as->start;
 
-	rb_itor *it = rb_itor_new(as->area_tree);
-	bool node_valid;
-	unsigned long last_end = min;
-	struct vm_region *f = nullptr;
-
-	if(min != as->start)
-		node_valid = rb_itor_search_ge(it, (const void *) min);
-	else
-	{
-		node_valid = rb_itor_first(it);
-	}
-
-	if(!node_valid)
-			goto done;
-	
-
-	/* Check if there's a gap between the first node
-	 * and the start of the address space
-	*/
+	size = size_to_pages(size) << PAGE_SHIFT;
 
-	f = (struct vm_region *) *rb_itor_datum(it);
+	unsigned long addr;
+	rb_node *root = rb_tree_root(as->area_tree);
 
-#if DEBUG_VM
-	printf("Tiniest node: %016lx\n", f->start);
-#endif
-	if(f->start - min >= size)
-	{
-#if DEBUG_VM
-		printf("gap [%016lx - %016lx]\n", min, f->start);
-#endif
-		goto done;
-	}
-	
-	while(node_valid)
+	if(!vm_find_gap(root, as->start, min, size, &addr))
 	{
-		struct vm_region *f = (struct vm_region *) *rb_itor_datum(it);
-		last_end = f->start + f->size;
- 
-		node_valid = rb_itor_next(it);
-		if(!node_valid)
-			break;
+		/* Nothing fits between regions, try the tail of the address space */
+		unsigned long last_end = root ?
+			((struct vm_region *) rb_node_datum(root))->subtree_end : as->start;
 
-		struct vm_region *vm = (struct vm_region *) *rb_itor_datum(it);
-
-		if(vm->start - last_end >= size && min <= vm->start)
-			break;
+		if(!vm_gap_fits(last_end, as->end, min, size, &addr))
+			return NULL;
 	}
 
-done:
-	rb_itor_free(it);
-
-	last_end = last_end < min ? min : last_end;
-
 #if DEBUG_VM
-	printf("Ptr: %lx\nSize: %lx\n", last_end, size);
+	printf("Ptr: %lx\nSize: %lx\n", addr, size);
 #endif
-	return vm_reserve_region(as, last_end, size);
+	return vm_reserve_region(as, addr, size);
 }
 
 void vm_init(void)
 {
-	kernel_address_space.area_tree = rb_tree_new(vm_cmp);
+	kernel_address_space.area_tree = vm_create_area_tree();
 	kernel_address_space.start = KADDR_START;
 	kernel_address_space.end = UINTPTR_MAX;
 
@@ -153,53 +238,110 @@ void vm_init(void)
 	}
 
 	malloc_reserve_memory_space();
+
+	/* The initial reference is never dropped, so it's never freed */
+	vm_zero_page = alloc_pages(1, 0);
+	if(!vm_zero_page)
+		panic("vm_init: couldn't allocate the zero page");
 }
 
 void vm_remove_region(struct address_space *as, struct vm_region *region)
 {
+	for(unsigned int i = 0; i < VM_REGION_CACHE_SIZE; i++)
+	{
+		if(as->region_cache[i] == region)
+			as->region_cache[i] = nullptr;
+	}
+
 	dict_remove_result res = rb_tree_remove(as->area_tree,
 						 (const void *) region->start);
 	assert(res.removed == true);
 }
 
-void vm_destroy_region(struct address_space *as, struct vm_region *region)
+/* Drops the region's vmo and frees it; it must be out of the tree already */
+static void vm_free_region(struct vm_region *region)
 {
-	vm_remove_region(as, region);	
-	/* Slowly destroy the vm region object now */
 	if(region->vmo)
+	{
+		region->vmo->remove_mapping(region);
 		region->vmo->unref();
+	}
+
+	slab_free(&vm_region_cache, region);
+}
 
-	free(region);
+void vm_destroy_region(struct address_space *as, struct vm_region *region)
+{
+	vm_remove_region(as, region);	
+	/* Slowly destroy the vm region object now */
+	vm_free_region(region);
 }
 
 void vm_assign_vmo(struct vm_region *region, vm_object *vmo)
 {
 	region->vmo = vmo;
+	vmo->add_mapping(region);
 }
 
+/* Pages looked up in the vmo at a time */
+#define VM_UPDATE_MAPPING_BATCH		64
+
+/* Maps [off, off + len) of the region, which must be resident. Physically
+ * contiguous runs of pages are handed to the mapper whole, so they can end
+ * up in huge pages. */
 int vm_update_mapping(struct address_space *as, struct vm_region *region, size_t off, size_t len)
 {
 	size_t nr_pages = size_to_pages(len);
-	unsigned long start = region->start + off;
+	unsigned long addr = region->start + off;
+	vm_object *vmo = region->vmo;
+	struct page *pages[VM_UPDATE_MAPPING_BATCH];
+	unsigned long run_start = addr;
+	uintptr_t run_phys = 0;
+	size_t run_len = 0;
+	int st = 0;
+
+	vmo->lock.Lock();
 
-	while(nr_pages--)
+	while(nr_pages && st == 0)
 	{
-		struct page *p = region->vmo->get(off);
+		size_t nr = nr_pages < VM_UPDATE_MAPPING_BATCH ? nr_pages : VM_UPDATE_MAPPING_BATCH;
 
-		assert(p != nullptr);
+		vmo->get_resident(off, nr, pages);
 
-		if(!__map_phys_to_virt(as->arch_priv, start + off,
-				       (unsigned long) p->paddr, region->perms))
+		for(size_t i = 0; i < nr; i++, addr += PAGE_SIZE)
 		{
-			region->vmo->lock.Unlock();
-			return -1;
+			assert(pages[i] != nullptr);
+
+			uintptr_t phys = (uintptr_t) pages[i]->paddr;
+
+			if(run_len && phys == run_phys + run_len)
+			{
+				run_len += PAGE_SIZE;
+				continue;
+			}
+
+			if(run_len && __map_phys_range(as->arch_priv, run_start, run_phys,
+						       run_len, region->perms) < 0)
+			{
+				st = -1;
+				break;
+			}
+
+			run_start = addr;
+			run_phys = phys;
+			run_len = PAGE_SIZE;
 		}
 
-		off += PAGE_SIZE;
-		region->vmo->lock.Unlock();
+		off += nr << PAGE_SHIFT;
+		nr_pages -= nr;
 	}
 
-	return 0;
+	if(st == 0 && run_len)
+		st = __map_phys_range(as->arch_priv, run_start, run_phys, run_len, region->perms);
+
+	vmo->lock.Unlock();
+
+	return st;
 }
 
 void kasan_alloc_shadow(unsigned long addr, size_t size, bool accessible);
@@ -207,31 +349,89 @@ void kasan_alloc_shadow(unsigned long addr, size_t size, bool accessible);
 namespace Vm
 {
 
+static inline bool vm_region_contains(struct vm_region *region, unsigned long addr)
+{
+	return region->start <= addr && region->start + region->size > addr;
+}
+
 struct vm_region *FindRegion(void *addr, rb_tree *tree)
 {
-	rb_itor *it = rb_itor_new(tree);
+	/* Regions don't overlap, so only the last one starting at or below
+	 * addr can contain it */
+	void **datum = rb_tree_search_le(tree, addr);
 
-	if(!rb_itor_search_le(it, addr))
+	if(!datum)
 		return NULL;
-	
-	while(true)
+
+	struct vm_region *region = (struct vm_region *) *datum;
+	if(vm_region_contains(region, (unsigned long) addr))
+		return region;
+
+	return NULL;
+}
+
+/* Like FindRegion, but tries the address space's MRU cache first, which
+ * catches the common run of faults over the same mapping.
+ * Must be called with as->lock held in either mode. Shared holders may race
+ * on the cache; that can only lose or duplicate entries, and every entry
+ * stays a live region until the exclusive holder clears it. */
+struct vm_region *FindRegionCached(struct address_space *as, void *addr)
+{
+	struct vm_region **cache = as->region_cache;
+
+	for(unsigned int i = 0; i < VM_REGION_CACHE_SIZE; i++)
 	{
-		struct vm_region *region = (struct vm_region *) *rb_itor_datum(it);
-		if(region->start <= (unsigned long) addr
-			&& region->start + region->size > (unsigned long) addr)
+		struct vm_region *region = __atomic_load_n(&cache[i], __ATOMIC_RELAXED);
+
+		if(region && vm_region_contains(region, (unsigned long) addr))
 		{
-			rb_itor_free(it);
+			/* Move to the front */
+			for(; i > 0; i--)
+				__atomic_store_n(&cache[i], __atomic_load_n(&cache[i - 1],
+						 __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+			__atomic_store_n(&cache[0], region, __ATOMIC_RELAXED);
 			return region;
 		}
+	}
 
-		if(!rb_itor_next(it))
-		{
-			break;
-		}
+	struct vm_region *region = FindRegion(addr, as->area_tree);
+
+	if(region)
+	{
+		for(unsigned int i = VM_REGION_CACHE_SIZE - 1; i > 0; i--)
+			__atomic_store_n(&cache[i], __atomic_load_n(&cache[i - 1],
+					 __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+		__atomic_store_n(&cache[0], region, __ATOMIC_RELAXED);
 	}
 
-	rb_itor_free(it);
-	return NULL;
+	return region;
+}
+
+static size_t fault_around_pages = 16;
+static atomic<size_t> nr_faults{0};
+static atomic<size_t> nr_fault_around_pages{0};
+static atomic<size_t> nr_zero_page_maps{0};
+static atomic<size_t> nr_huge_page_maps{0};
+
+void GetFaultStats(struct vm_fault_stats *stats)
+{
+	stats->faults = nr_faults.load(mem_order::relaxed);
+	stats->fault_around_pages = nr_fault_around_pages.load(mem_order::relaxed);
+	stats->zero_page_maps = nr_zero_page_maps.load(mem_order::relaxed);
+	stats->huge_page_maps = nr_huge_page_maps.load(mem_order::relaxed);
+}
+
+void SetFaultAround(size_t nr_pages)
+{
+	size_t nr = 1;
+
+	if(nr_pages > VM_FAULT_AROUND_MAX_PAGES)
+		nr_pages = VM_FAULT_AROUND_MAX_PAGES;
+
+	while(nr << 1 <= nr_pages)
+		nr <<= 1;
+
+	__atomic_store_n(&fault_around_pages, nr, __ATOMIC_RELAXED);
 }
 
 void VmFault::Dump()
@@ -263,14 +463,176 @@ unsigned long VmFault::FlagsToPerms()
 	return perms;
 }
 
+/* Maps the already resident pages of the vmo that surround the fault, in an
+ * aligned window of fault_around_pages, so streaming through a mapping
+ * doesn't trap once per page. Nothing gets committed here.
+ * Called with the vmo lock held. */
+void VmFault::FaultAround(struct vm_region *region, unsigned long fault_addr)
+{
+	size_t nr = __atomic_load_n(&fault_around_pages, __ATOMIC_RELAXED);
+
+	if(nr <= 1 || region->flags & VM_REGION_NO_FAULT_AROUND)
+		return;
+
+	unsigned long start = fault_addr & ~(nr * PAGE_SIZE - 1);
+	unsigned long end = start + nr * PAGE_SIZE;
+	unsigned long region_end = region->start + region->size;
+
+	if(start < region->start)
+		start = region->start;
+	if(end > region_end)
+		end = region_end;
+
+	nr = (end - start) >> PAGE_SHIFT;
+	if(nr <= 1)
+		return;
+
+	struct page *pages[VM_FAULT_AROUND_MAX_PAGES];
+	size_t vmo_off = start - region->start + region->off;
+
+	if(region->vmo->get_resident(vmo_off, nr, pages) <= 1)
+		return;
+
+	/* The faulting page has been mapped already */
+	pages[(fault_addr - start) >> PAGE_SHIFT] = nullptr;
+
+	auto as = Vm::get_current_address_space();
+	size_t mapped = __map_pages_batch(as->arch_priv, start, pages, nr, region->perms);
+
+	nr_fault_around_pages.add_fetch(mapped, mem_order::relaxed);
+}
+
+/* Maps the VM_HUGE_PAGE_SIZE chunk around addr with a single PML2 entry, if
+ * it's inside the region, lines up with a chunk of the vmo and that chunk is
+ * resident and physically contiguous. Called with the vmo lock held.
+ * Returns false if the caller needs to map single pages instead. */
+static bool MapHugePage(struct address_space *as, struct vm_region *region, unsigned long addr)
+{
+	unsigned long start = addr & ~(VM_HUGE_PAGE_SIZE - 1);
+
+	if(start < region->start || start + VM_HUGE_PAGE_SIZE > region->start + region->size)
+		return false;
+
+	size_t vmo_off = start - region->start + region->off;
+
+	if(vmo_off & (VM_HUGE_PAGE_SIZE - 1))
+		return false;
+
+	struct page *pages[VM_FAULT_AROUND_MAX_PAGES];
+	uintptr_t phys = 0;
+
+	for(size_t i = 0; i < VM_HUGE_PAGE_PAGES; i += VM_FAULT_AROUND_MAX_PAGES)
+	{
+		if(region->vmo->get_resident(vmo_off + (i << PAGE_SHIFT), VM_FAULT_AROUND_MAX_PAGES,
+					     pages) != VM_FAULT_AROUND_MAX_PAGES)
+			return false;
+
+		if(i == 0)
+		{
+			phys = (uintptr_t) pages[0]->paddr;
+			if(phys & (VM_HUGE_PAGE_SIZE - 1))
+				return false;
+		}
+
+		for(size_t j = 0; j < VM_FAULT_AROUND_MAX_PAGES; j++)
+		{
+			if((uintptr_t) pages[j]->paddr != phys + ((i + j) << PAGE_SHIFT))
+				return false;
+		}
+	}
+
+	/* If part of the chunk was mapped with single pages before, this
+	 * fills in the rest of that PML1 instead */
+	if(__map_phys_range(as->arch_priv, start, phys, VM_HUGE_PAGE_SIZE, region->perms) < 0)
+		return false;
+
+	nr_huge_page_maps.add_fetch(1, mem_order::relaxed);
+
+	return true;
+}
+
+/* Maps page at addr. Called with the vmo lock held; if needs_flush comes
+ * back set, a present pte was replaced and the caller has to FlushPage()
+ * once the lock is dropped. */
+enum VmFaultStatus VmFault::MapPage(struct vm_region *region, unsigned long addr,
+				     struct page *page, unsigned long perms, bool shared,
+				     bool& needs_flush)
+{
+	auto as = Vm::get_current_address_space();
+
+	needs_flush = false;
+
+	if(shared)
+	{
+		/* Don't clobber the private copy a racing write fault may have
+		 * mapped in the meantime */
+		__map_pages_batch(as->arch_priv, addr, &page, 1, perms & ~VM_PROT_WRITE);
+
+		if(page == vm_zero_page)
+			nr_zero_page_maps.add_fetch(1, mem_order::relaxed);
+	}
+	else
+	{
+		/* Write faults can be replacing a read-only pte to a shared
+		 * page, which other cpus may have cached too */
+		if(!__remap_phys_to_virt(as->arch_priv, addr, (unsigned long) page->paddr, perms,
+					 &needs_flush))
+			return VmFaultStatus::VM_SEGFAULT;
+	}
+
+	FaultAround(region, addr);
+
+	return VmFaultStatus::VM_OK;
+}
+
+void VmFault::FlushPage(unsigned long addr)
+{
+	struct mmu_gather tlb;
+
+	mmu_gather_init(&tlb, Vm::get_current_address_space());
+	mmu_gather_add_page(&tlb, addr);
+	mmu_gather_flush(&tlb);
+}
+
 enum VmFaultStatus VmFault::TryToMapPage(struct vm_region *region)
 {
 	auto vmo = region->vmo;
 	unsigned long fault_addr_aligned = fault_address & ~(PAGE_SIZE - 1);
 	size_t vmo_off = fault_addr_aligned - region->start + region->off;
 	vmo_off &= ~(PAGE_SIZE - 1);
-	size_t off = fault_addr_aligned - region->start;
 	
+	nr_faults.add_fetch(1, mem_order::relaxed);
+
+	/* The vmo may have been shrunk from under the mapping */
+	if(vmo_off >= vmo->get_size())
+		return VmFaultStatus::VM_SIGBUS;
+
+	/* Huge-page vmos don't share pages, and reads need to commit the
+	 * whole chunk so it can be mapped in one go */
+	if(!is_write && !vmo->huge_pages())
+	{
+		/* Reads can be served by pages the vmo shares with others,
+		 * e.g. the parent of a COW clone */
+		bool shared;
+		auto page = vmo->get_readonly(vmo_off, shared);
+
+		if(page)
+		{
+			bool needs_flush;
+
+			vmo->lock.Lock();
+			auto st = MapPage(region, fault_addr_aligned, page, region->perms, shared,
+					  needs_flush);
+			vmo->lock.Unlock();
+
+			if(needs_flush)
+				FlushPage(fault_addr_aligned);
+
+			free_page(page);
+			return st;
+		}
+	}
+
 	auto page = vmo->get(vmo_off);
 
 	if(!page)
@@ -287,23 +649,36 @@ enum VmFaultStatus VmFault::TryToMapPage(struct vm_region *region)
 			return VmFaultStatus::VM_SEGFAULT;
 	}
 
-	if(!map_phys_to_virt(region->start + off, (unsigned long ) page->paddr, region->perms))
+	if(vmo->huge_pages() &&
+	   MapHugePage(Vm::get_current_address_space(), region, fault_addr_aligned))
 	{
-		return VmFaultStatus::VM_SEGFAULT;
+		vmo->lock.Unlock();
+		return VmFaultStatus::VM_OK;
 	}
 
+	bool needs_flush;
+	auto st = MapPage(region, fault_addr_aligned, page, region->perms, false, needs_flush);
+
 	vmo->lock.Unlock();
-	return VmFaultStatus::VM_OK;
+
+	if(needs_flush)
+		FlushPage(fault_addr_aligned);
+
+	return st;
 }
 
 enum VmFaultStatus VmFault::Handle()
 {
 	auto address_space = Vm::get_current_address_space();
 
-	scoped_spinlock l{&address_space->lock};
-	auto region = FindRegion((void *) fault_address, address_space->area_tree);
+	/* Faults only read the region tree, so they can run in parallel;
+	 * the vmo lock and the page table code deal with racing commits */
+	scoped_rw_spinlock<scoped_rwlock_read> l{&address_space->lock};
+	auto region = FindRegionCached(address_space, (void *) fault_address);
 
-	if(!region)
+	/* Regions without a vmo are reservations, like the kernel stack
+	 * guard pages; nothing gets mapped there on demand */
+	if(!region || !region->vmo)
 		return VmFaultStatus::VM_SEGFAULT;
 	
 	unsigned long perms = FlagsToPerms();
@@ -328,7 +703,7 @@ struct vm_region *AllocateRegionInternal(struct address_space *as, unsigned long
 struct vm_region *MmapInternal(struct address_space *as, unsigned long min, size_t size,
 			       unsigned long flags, vm_object *vmo)
 {
-	scoped_spinlock guard{&as->lock};
+	scoped_rw_spinlock<scoped_rwlock_write> guard{&as->lock};
 	size = size_to_pages(size) << PAGE_SHIFT;
 	struct vm_region *reg = AllocateRegionInternal(as, min, size);
 
@@ -373,6 +748,8 @@ void *mmap(struct address_space *as, unsigned long min, size_t size, unsigned lo
 		return nullptr;
 	}
 
+	phys->set_anonymous();
+
 	struct vm_region *region = MmapInternal(as, min, size, flags, phys);
 	if(!region)	return nullptr;
 	return (void *) region->start;
@@ -385,24 +762,60 @@ int vm_add_region(struct address_space *as, struct vm_region *region)
 	if(!res.inserted)
 		return -1;
 	*res.datum_ptr = (void *) region;
+	vm_region_changed(as, region);
 
 	return 0;
 }
 
+/* Returns true if every page of [addr, addr + size) is inside a region */
+static bool vm_range_is_mapped(struct address_space *as, unsigned long addr, size_t size)
+{
+	unsigned long limit = addr + size;
+
+	while(addr < limit)
+	{
+		auto region = FindRegion((void *) addr, as->area_tree);
+		if(!region)
+			return false;
+
+		addr = region->start + region->size;
+	}
+
+	return true;
+}
+
+/* munmap trims (and frees the pages of) vmos that nothing but the region
+ * maps, one to one; everyone else's are left alone, just mapped by less */
+static bool vm_region_owns_vmo(struct vm_region *region)
+{
+	return region->vmo && region->off == 0 && region->vmo->get_size() == region->size &&
+	       region->vmo->mapped_only_by(region);
+}
+
 int munmap(struct address_space *as, void *__addr, size_t size)
 {
 	unsigned long addr = (unsigned long) __addr;
 	auto limit = addr + size;
+	struct mmu_gather tlb;
+
+	scoped_rw_spinlock<scoped_rwlock_write> l{&as->lock};
+
+	if(!vm_range_is_mapped(as, addr, size))
+		return -EINVAL;
+
+	/* The page tables go first, with a single flush for the whole range,
+	 * since trimming the vmos below frees their pages */
+	mmu_gather_init(&tlb, as);
+	int st = unmap_page_range_gather(&tlb, __addr, size);
+	mmu_gather_flush(&tlb);
 
-	scoped_spinlock l(&as->lock);
+	if(st < 0)
+		return -ENOMEM;
 
 	while(addr < limit)
 	{
 		auto region = FindRegion((void *) addr, as->area_tree);
-		if(!region)
-		{
-			return -EINVAL;
-		}
+		bool owns_vmo = vm_region_owns_vmo(region);
 		
 		size_t to_shave_off = 0;
 		if(region->start == addr)
@@ -417,8 +830,22 @@ int munmap(struct address_space *as, void *__addr, size_t size)
 				region->size -= to_shave_off;
 
 				if(vm_add_region(as, region) < 0)
+				{
+					/* Put it back the way it was. If even that
+					 * fails, it goes the way of its mappings. */
+					region->start -= to_shave_off;
+					region->size += to_shave_off;
+
+					if(vm_add_region(as, region) < 0)
+						vm_free_region(region);
+
 					return -ENOMEM;
-				region->vmo->truncate_beginning_and_resize(to_shave_off);
+				}
+
+				/* If the vmo can't be shifted, just map less of it */
+				if(!owns_vmo ||
+				   region->vmo->truncate_beginning_and_resize(to_shave_off) < 0)
+					region->off += to_shave_off;
 			}
 			else
 			{
@@ -445,30 +872,41 @@ int munmap(struct address_space *as, void *__addr, size_t size)
 					return -ENOMEM;
 				}
 
-				vm_remove_region(as, region);
-
-				vm_object *second = region->vmo->split(offset, to_shave_off);
-				if(!second)
+				if(owns_vmo)
 				{
-					vm_remove_region(as, new_region);
-					return -ENOMEM;
+					vm_object *second = region->vmo->split(offset, to_shave_off);
+					if(!second)
+					{
+						vm_destroy_region(as, new_region);
+						return -ENOMEM;
+					}
+
+					vm_assign_vmo(new_region, second);
+				}
+				else if(region->vmo)
+				{
+					new_region->off = region->off + offset + to_shave_off;
+					region->vmo->ref();
+					vm_assign_vmo(new_region, region->vmo);
 				}
 
-				new_region->vmo = second;
+				new_region->perms = region->perms;
+				new_region->flags = region->flags;
 
 				/* The original region's size is offset */
 				region->size = offset;
+				vm_region_changed(as, region);
 
 			}
 			else
 			{
-				region->vmo->resize(region->size - to_shave_off);
+				if(owns_vmo)
+					region->vmo->resize(region->size - to_shave_off);
 				region->size -= to_shave_off;
+				vm_region_changed(as, region);
 			}
 		}
 
-		unmap_page_range(NULL, (void *) addr, to_shave_off);
-
 		addr += to_shave_off;
 		size -= to_shave_off;
 	}
@@ -476,6 +914,134 @@ int munmap(struct address_space *as, void *__addr, size_t size)
 	return 0;
 }
 
+/* Splits region in two at addr, which must be page aligned and inside it.
+ * The part from addr on becomes a new region mapping the same vmo, which
+ * is returned. */
+static struct vm_region *vm_split_region(struct address_space *as, struct vm_region *region,
+					 unsigned long addr)
+{
+	size_t offset = addr - region->start;
+	size_t old_size = region->size;
+
+	region->size = offset;
+	vm_region_changed(as, region);
+
+	auto new_region = vm_reserve_region(as, addr, old_size - offset);
+	if(!new_region)
+	{
+		region->size = old_size;
+		vm_region_changed(as, region);
+		return nullptr;
+	}
+
+	new_region->perms = region->perms;
+	new_region->flags = region->flags;
+	new_region->off = region->off + offset;
+
+	if(region->vmo)
+	{
+		region->vmo->ref();
+		vm_assign_vmo(new_region, region->vmo);
+	}
+
+	return new_region;
+}
+
+int mprotect(struct address_space *as, void *__addr, size_t size, unsigned long prot)
+{
+	unsigned long addr = (unsigned long) __addr;
+	unsigned long limit = addr + size;
+	struct mmu_gather tlb;
+	int st = 0;
+
+	prot &= VM_PROT_WRITE | VM_PROT_EXEC;
+
+	scoped_rw_spinlock<scoped_rwlock_write> l{&as->lock};
+
+	if(!vm_range_is_mapped(as, addr, size))
+		return -EINVAL;
+
+	mmu_gather_init(&tlb, as);
+
+	while(addr < limit)
+	{
+		auto region = FindRegion((void *) addr, as->area_tree);
+
+		/* Regions that stick out of the range get split, so that the
+		 * new permissions always apply to whole regions */
+		if(region->start < addr && !(region = vm_split_region(as, region, addr)))
+		{
+			st = -ENOMEM;
+			break;
+		}
+
+		if(region->start + region->size > limit && !vm_split_region(as, region, limit))
+		{
+			st = -ENOMEM;
+			break;
+		}
+
+		region->perms = (region->perms & ~(VM_PROT_WRITE | VM_PROT_EXEC)) | prot;
+
+		if(protect_page_range_gather(&tlb, (void *) region->start, region->size,
+					     region->perms) < 0)
+		{
+			st = -ENOMEM;
+			break;
+		}
+
+		addr = region->start + region->size;
+	}
+
+	mmu_gather_flush(&tlb);
+
+	return st;
+}
+
+/* Maps the resident pages of the region, one page-table walk per batch.
+ * The caller commits them beforehand with vmo->populate(), without the
+ * lock; anything decommitted since gets faulted in as usual.
+ * Called with as->lock held shared. */
+int PopulateRegion(struct address_space *as, struct vm_region *region)
+{
+	auto vmo = region->vmo;
+
+	struct page *pages[VM_FAULT_AROUND_MAX_PAGES];
+	unsigned long addr = region->start;
+	unsigned long end = region->start + region->size;
+
+	while(addr < end)
+	{
+		/* A batch can't cross into the next PML1 */
+		size_t nr = (end - addr) >> PAGE_SHIFT;
+		size_t to_table_end = 512 - ((addr >> PAGE_SHIFT) & 511);
+
+		if(nr > to_table_end)
+			nr = to_table_end;
+		if(nr > VM_FAULT_AROUND_MAX_PAGES)
+			nr = VM_FAULT_AROUND_MAX_PAGES;
+
+		vmo->lock.Lock();
+
+		if(vmo->huge_pages() && !(addr & (VM_HUGE_PAGE_SIZE - 1)) &&
+		   MapHugePage(as, region, addr))
+		{
+			vmo->lock.Unlock();
+			addr += VM_HUGE_PAGE_SIZE;
+			continue;
+		}
+
+		vmo->get_resident(addr - region->start + region->off, nr, pages);
+		__map_pages_batch(as->arch_priv, addr, pages, nr, region->perms);
+
+		vmo->lock.Unlock();
+
+		addr += nr << PAGE_SHIFT;
+	}
+
+	return 0;
+}
+
 void *MmioMap(struct address_space *as, unsigned long phys, unsigned long min,
 	      size_t size, unsigned long flags)
 {
@@ -520,15 +1086,18 @@ void *allocate_stack(struct address_space *as, size_t size, unsigned long flags)
 		return nullptr;
 	return (void *)((char *) mem + size);
 }
-/* TODO: Implement mprotect */
 
 void *map_file(struct address_space *as, void *addr_hint,
 		      unsigned long flags, unsigned long prot,
 		      size_t size, size_t off, inode *ino)
 {
-	bool is_fixed = flags == MAP_FILE_FIXED;
+	bool is_fixed = flags & MAP_FILE_FIXED;
+	bool is_private = flags & MAP_FILE_PRIVATE;
 	struct vm_region *region = nullptr;
 
+	if(!ino->create_vmobject_if_needed())
+		return nullptr;
+
 	if(is_fixed)
 	{
 		region = vm_reserve_region(as, (unsigned long) addr_hint, size);
@@ -539,8 +1108,24 @@ void *map_file(struct address_space *as, void *addr_hint,
 		panic("implement");
 	
 	region->perms = prot;
-	region->off = off;
-	region->vmo = ino->i_pages;
+
+	if(is_private)
+	{
+		/* Writes go to private copies instead of the page cache */
+		auto cow = new vm_object_cow(ino->i_pages, off, size_to_pages(size));
+		if(!cow)
+		{
+			vm_destroy_region(as, region);
+			return nullptr;
+		}
+
+		vm_assign_vmo(region, cow);
+	}
+	else
+	{
+		region->off = off;
+		vm_assign_vmo(region, ino->i_pages);
+	}
 
 	return (void *) region->start;
 }
@@ -652,12 +1237,17 @@ cbn_status_t cbn_mmap_in_place(address_space *address_space, void *hint, size_t
 		return CBN_STATUS_OUT_OF_MEMORY;
 		
 }
+
+/* Creates the region and maps vmo with it. Only where it ended up is handed
+ * back, since the region can be unmapped as soon as the lock is dropped. */
 cbn_status_t cbn_mmap_create_vmregion(process *target, void *hint, size_t length,
-				   size_t off, long flags, long prot, vm_region *&out_region)
+				   size_t off, long flags, long prot, vm_object *vmo,
+				   unsigned long& out_start, size_t& out_size)
 {
 	auto address_space = &target->address_space;
-	scoped_spinlock guard{&address_space->lock};
+	scoped_rw_spinlock<scoped_rwlock_write> guard{&address_space->lock};
 	cbn_status_t st = 0;
+	struct vm_region *region = nullptr;
 
 	bool fixed = flags & MAP_FILE_FIXED;
 	
@@ -667,29 +1257,33 @@ cbn_status_t cbn_mmap_create_vmregion(process *target, void *hint, size_t length
 	{
 		/* If it's fixed and the in place mapping fails, error out */
 		if((st = cbn_mmap_in_place(address_space, hint, length, off,
-			prot, out_region)) != CBN_STATUS_OK)
+			prot, region)) != CBN_STATUS_OK)
 		{
 			return st;
 		}
 	}
+	else if(hint != nullptr)
+		cbn_mmap_in_place(address_space, hint, length, off, prot, region);
 
-	if(hint != nullptr)
+	if(!region)
 	{
-		if((st = cbn_mmap_in_place(address_space, hint, length, off,
-			prot, out_region)) == CBN_STATUS_OK)
-		{
-			return st;
-		}
+		region = Vm::AllocateRegionInternal(address_space, address_space->start,
+						    length);
+		if(!region)
+			return CBN_STATUS_OUT_OF_MEMORY;
+
+		region->perms = cbn_mmap_to_vm_prots(prot);
+		region->off = off;
 	}
 
-	struct vm_region *region = Vm::AllocateRegionInternal(address_space,
-					address_space->start,
-					length);
-	if(!region)
-		return CBN_STATUS_OUT_OF_MEMORY;
-	region->perms = cbn_mmap_to_vm_prots(prot);
-	region->off = off;
-	out_region = region;
+	vm_assign_vmo(region, vmo);
+
+	if(flags & MAP_FLAG_NO_FAULT_AROUND)
+		region->flags |= VM_REGION_NO_FAULT_AROUND;
+
+	out_start = region->start;
+	out_size = region->size;
+
 	return CBN_STATUS_OK;
 }
 
@@ -715,21 +1309,120 @@ cbn_status_t sys_cbn_mmap(cbn_handle_t process_handle, cbn_handle_t vmo_handle,
 	if((st = cbn_mmap_get_vm_object_for_map(vmo_handle, kargs.flags, target_vmo)) != CBN_STATUS_OK)
 		return CBN_STATUS_OK;
 
-	vm_region *region = nullptr;
+	auto as = &target_process->address_space;
+	bool populate = kargs.flags & MAP_FLAG_POPULATE;
+	unsigned long start;
+	size_t size;
+
+	/* The region takes over our reference; populating needs its own, as
+	 * the region can go away once the lock is dropped */
+	if(populate)
+		target_vmo->ref();
+
 	if((st = cbn_mmap_create_vmregion(target_process, hint, kargs.length,
-					 kargs.off, kargs.flags, prot, region)) != CBN_STATUS_OK)
+					 kargs.off, kargs.flags, prot, target_vmo,
+					 start, size)) != CBN_STATUS_OK)
 	{
+		if(populate)
+			target_vmo->unref();
 		target_vmo->unref();
 		return st;
 	}
 
-	region->vmo = target_vmo;
+	if(populate)
+	{
+		/* Committing (and zeroing) the whole range can take a while, so
+		 * it's done without as->lock; only the mapping pass needs it */
+		int pst = target_vmo->populate(kargs.off, size);
+
+		if(pst == 0)
+		{
+			scoped_rw_spinlock<scoped_rwlock_read> guard{&as->lock};
+
+			/* Another thread may have unmapped it in the meantime */
+			auto region = FindRegion((void *) start, as->area_tree);
+
+			if(region && region->start == start && region->vmo == target_vmo)
+				PopulateRegion(as, region);
+		}
+
+		target_vmo->unref();
+
+		if(pst < 0)
+		{
+			munmap(as, (void *) start, size);
+			return CBN_STATUS_OUT_OF_MEMORY;
+		}
+	}
 
-	if(copy_to_user(result, &region->start, sizeof(void *)) < 0)
+	if(copy_to_user(result, &start, sizeof(void *)) < 0)
 	{
-		vm_destroy_region(&target_process->address_space, region);
+		/* Goes through munmap since the range may be mapped already */
+		munmap(as, (void *) start, size);
 		return CBN_STATUS_SEGFAULT;
 	}
 
 	return CBN_STATUS_OK;
-}
\ No newline at end of file
+}
+
+/* Checks [ptr, ptr + length) is a page aligned, non-empty range of the user
+ * half of as; length gets rounded up to pages */
+static cbn_status_t cbn_check_user_range(struct address_space *as, void *ptr, size_t& length)
+{
+	unsigned long addr = (unsigned long) ptr;
+
+	if(addr & (PAGE_SIZE - 1) || !length || length > SIZE_MAX - PAGE_SIZE)
+		return CBN_STATUS_INVALID_ARGUMENT;
+
+	length = page_align_up(length);
+
+	if(addr + length < addr || !Vm::is_valid_user_range(as, addr, length))
+		return CBN_STATUS_INVALID_ARGUMENT;
+
+	return CBN_STATUS_OK;
+}
+
+cbn_status_t sys_cbn_unmap(cbn_handle_t process_handle, void *ptr, size_t length)
+{
+	auto target_process = get_process_from_handle(process_handle);
+	cbn_status_t st = CBN_STATUS_OK;
+
+	if(!target_process)
+		return CBN_STATUS_INVALID_HANDLE;
+
+	auto as = &target_process->address_space;
+
+	if((st = cbn_check_user_range(as, ptr, length)) != CBN_STATUS_OK)
+		return st;
+
+	int ret = Vm::munmap(as, ptr, length);
+
+	if(ret == -EINVAL)
+		return CBN_STATUS_INVALID_ARGUMENT;
+
+	return ret < 0 ? CBN_STATUS_OUT_OF_MEMORY : CBN_STATUS_OK;
+}
+
+cbn_status_t sys_cbn_protect(cbn_handle_t process_handle, void *ptr, size_t length, long prot)
+{
+	auto target_process = get_process_from_handle(process_handle);
+	cbn_status_t st = CBN_STATUS_OK;
+
+	if(!target_process)
+		return CBN_STATUS_INVALID_HANDLE;
+
+	if(prot & ~(MAP_PROT_READ | MAP_PROT_WRITE | MAP_PROT_EXEC))
+		return CBN_STATUS_INVALID_ARGUMENT;
+
+	auto as = &target_process->address_space;
+
+	if((st = cbn_check_user_range(as, ptr, length)) != CBN_STATUS_OK)
+		return st;
+
+	int ret = Vm::mprotect(as, ptr, length, cbn_mmap_to_vm_prots(prot));
+
+	if(ret == -EINVAL)
+		return CBN_STATUS_INVALID_ARGUMENT;
+
+	return ret < 0 ? CBN_STATUS_OUT_OF_MEMORY : CBN_STATUS_OK;
+}
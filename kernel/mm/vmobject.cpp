@@ -5,6 +5,7 @@
 */
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 
 #include <carbon/lock.h>
 #include <carbon/vmobject.h>
@@ -14,20 +15,52 @@
 #include <carbon/panic.h>
 #include <carbon/syscall_utils.h>
 
+#include <carbon/public/vm.h>
+
+/* Pages handed to add_pages() at a time by commits of several pages */
+#define VM_OBJECT_ADD_BATCH		64
+
 int vm_object::add_page(size_t offset, struct page *page)
 {
 	scoped_spinlock l(&lock);
 
 	page->off = offset;
 
-	auto res = rb_tree_insert(&page_list, (void *) offset);
-	if(!res.inserted)
+	return radix_tree_insert(&page_index, offset >> PAGE_SHIFT, page);
+}
+
+/* Adds nr pages at consecutive offsets in one locked pass. Offsets that got
+ * committed in the meantime keep the page they have and ours get freed, as
+ * does everything left over if we run out of memory. Returns 0 or -ENOMEM. */
+int vm_object::add_pages(size_t offset, struct page **pages, size_t nr)
+{
+	scoped_spinlock l(&lock);
+
+	for(size_t i = 0; i < nr; i++)
+		pages[i]->off = offset + (i << PAGE_SHIFT);
+
+	size_t done = 0;
+
+	while(done < nr)
 	{
-		assert(res.datum_ptr != nullptr);
-		return -1;
-	}
+		long st = radix_tree_insert_range(&page_index, (offset >> PAGE_SHIFT) + done,
+						  (void **) pages + done, nr - done);
 
-	*res.datum_ptr = (void *) page;
+		if(st == -ENOMEM)
+		{
+			for(; done < nr; done++)
+				free_page(pages[done]);
+			return -ENOMEM;
+		}
+
+		if(st == -EEXIST)
+		{
+			free_page(pages[done]);
+			st = 1;
+		}
+
+		done += st;
+	}
 
 	return 0;
 }
@@ -36,12 +69,11 @@ struct page *vm_object::remove_page(size_t page_off)
 {
 	scoped_spinlock l(&lock);
 
-	struct page *target = nullptr;
-	auto res = rb_tree_remove(&page_list, (const void *) page_off);
+	struct page *target = (struct page *) radix_tree_delete(&page_index, page_off >> PAGE_SHIFT);
 
-	assert(res.removed == true);
+	assert(target != nullptr);
 
-	return (target = (struct page *) res.datum);
+	return target;
 }
 
 int vm_object::populate(size_t starting_off, size_t region_size)
@@ -50,6 +82,14 @@ int vm_object::populate(size_t starting_off, size_t region_size)
 
 	while(nr_pages--)
 	{
+		if(get(starting_off))
+		{
+			/* Already there, skip the allocation */
+			lock.Unlock();
+			starting_off += PAGE_SIZE;
+			continue;
+		}
+
 		int st = commit(starting_off);
 
 		if(st < 0)
@@ -67,26 +107,243 @@ struct page *vm_object::get(size_t offset)
 
 	assert((offset & (PAGE_SIZE - 1)) == 0);
 
-	void **pp = rb_tree_search(&page_list, (const void *) offset);
+	auto p = (struct page *) radix_tree_lookup(&page_index, offset >> PAGE_SHIFT);
 
-	return pp ? (struct page *) *pp : (lock.Unlock(), nullptr);
+	return p ? p : (lock.Unlock(), nullptr);
+}
+
+struct page *vm_object::get_readonly(size_t offset, bool& shared)
+{
+	shared = false;
+
+	auto p = get(offset);
+	if(!p)
+		return nullptr;
+
+	page_ref(p);
+	lock.Unlock();
+
+	return p;
+}
+
+/* Fills pages[] with the pages that back [offset, offset + nr_pages pages),
+ * NULL for the ones that aren't resident. Called with the lock held.
+ * Returns the number of resident pages found. */
+size_t vm_object::get_resident(size_t offset, size_t nr_pages, struct page **pages)
+{
+	assert((offset & (PAGE_SIZE - 1)) == 0);
+
+	return radix_tree_gang_lookup(&page_index, offset >> PAGE_SHIFT, nr_pages,
+				      (void **) pages);
+}
+
+struct page *vm_zero_page = nullptr;
+
+struct page *vm_object_phys::get_readonly(size_t offset, bool& shared)
+{
+	auto p = vm_object::get_readonly(offset, shared);
+
+	if(!p && anonymous && vm_zero_page)
+	{
+		p = vm_zero_page;
+		page_ref(p);
+		shared = true;
+	}
+
+	return p;
 }
 
 int vm_object_phys::commit(size_t offset)
 {
+	/* The page is allocated and zeroed without the vmo lock held, so
+	 * someone else may commit the same offset in the meantime */
 	struct page *p = alloc_pages(1, 0);
 
 	if(!p)
 		return -1;
-	if(add_page(offset, p) < 0)
+
+	int st = add_page(offset, p);
+	if(st < 0)
 	{
 		free_page(p);
+		/* Lost the race, but the offset is committed either way */
+		return st == -EEXIST ? 0 : -1;
+	}
+
+	return 0;
+}
+
+/* Commits nr (at most VM_OBJECT_ADD_BATCH) offsets starting at offset, with
+ * one allocator call and one locked insertion. pages is scratch space. */
+int vm_object_phys::commit_pages(size_t offset, size_t nr, struct page **pages)
+{
+	/* A physically contiguous run is cheaper to zero and lets the range
+	 * mapper use fewer, bigger mappings; don't insist on it though */
+	struct page *list = nr > 1 ? alloc_pages(nr, PAGE_ALLOC_CONTIGUOUS) : nullptr;
+
+	if(!list && !(list = alloc_pages(nr, 0)))
 		return -1;
+
+	for(size_t i = 0; i < nr; i++)
+	{
+		pages[i] = list;
+		list = list->next_un.next_allocation;
+		pages[i]->next_un.next_allocation = nullptr;
+	}
+
+	return add_pages(offset, pages, nr) < 0 ? -1 : 0;
+}
+
+int vm_object_phys::populate(size_t starting_off, size_t region_size)
+{
+	size_t nr_pages = size_to_pages(region_size);
+	struct page *pages[VM_OBJECT_ADD_BATCH];
+
+	while(nr_pages)
+	{
+		size_t nr = nr_pages < VM_OBJECT_ADD_BATCH ? nr_pages : VM_OBJECT_ADD_BATCH;
+
+		lock.Lock();
+		size_t found = get_resident(starting_off, nr, pages);
+		lock.Unlock();
+
+		/* Commit every hole in the batch in one go */
+		for(size_t i = 0; found != nr && i < nr;)
+		{
+			if(pages[i])
+			{
+				i++;
+				continue;
+			}
+
+			size_t end = i;
+
+			while(end < nr && !pages[end])
+				end++;
+
+			if(commit_pages(starting_off + (i << PAGE_SHIFT), end - i, pages + i) < 0)
+				return -1;
+
+			i = end;
+		}
+
+		starting_off += nr << PAGE_SHIFT;
+		nr_pages -= nr;
 	}
 
 	return 0;
 }
 
+int vm_object_huge::commit(size_t offset)
+{
+	size_t start = offset & ~(VM_HUGE_PAGE_SIZE - 1);
+	size_t end = nr_pages << PAGE_SHIFT;
+
+	if(start >= end)
+		return vm_object_phys::commit(offset);
+
+	size_t nr = (end - start) >> PAGE_SHIFT;
+	if(nr > VM_HUGE_PAGE_PAGES)
+		nr = VM_HUGE_PAGE_PAGES;
+
+	/* The buddy allocator hands out naturally aligned blocks, so a full
+	 * chunk is aligned for a PML2 mapping too */
+	struct page *pages = alloc_pages(nr, PAGE_ALLOC_CONTIGUOUS);
+
+	if(!pages)
+		return vm_object_phys::commit(offset);
+
+	struct page *batch[VM_OBJECT_ADD_BATCH];
+	int st = 0;
+
+	while(pages)
+	{
+		size_t n = 0;
+
+		/* Grab the links first, freeing a page clears them */
+		for(; pages && n < VM_OBJECT_ADD_BATCH; pages = pages->next_un.next_allocation)
+			batch[n++] = pages;
+
+		/* Offsets committed in the meantime keep their page, which
+		 * breaks the huge mapping but nothing else */
+		if(add_pages(start, batch, n) < 0 && offset >= start &&
+		   offset < start + (n << PAGE_SHIFT))
+			st = -1;
+
+		start += n << PAGE_SHIFT;
+	}
+
+	return st;
+}
+
+vm_object_cow::~vm_object_cow()
+{
+	destroy_tree([](void *data)
+	{
+		free_page((struct page *) data);
+	});
+
+	parent->remove_clone();
+	parent->unref();
+}
+
+struct page *vm_object_cow::get_readonly(size_t offset, bool& shared)
+{
+	auto p = vm_object::get_readonly(offset, shared);
+	if(p)
+		return p;
+
+	p = parent->get_readonly(parent_off + offset, shared);
+	shared = true;
+
+	return p;
+}
+
+int vm_object_cow::commit(size_t offset)
+{
+	struct page *p = alloc_pages(1, PAGE_ALLOC_NOZERO);
+
+	if(!p)
+		return -1;
+
+	bool shared;
+	void *dst = phys_to_virt(p->paddr);
+	struct page *src = parent->get_readonly(parent_off + offset, shared);
+
+	/* Offsets the parent never committed read as zeroes */
+	if(src)
+	{
+		memcpy(dst, phys_to_virt(src->paddr), PAGE_SIZE);
+		free_page(src);
+	}
+	else
+		memset(dst, 0, PAGE_SIZE);
+
+	int st = add_page(offset, p);
+	if(st < 0)
+	{
+		free_page(p);
+		return st == -EEXIST ? 0 : -1;
+	}
+
+	return 0;
+}
+
+int vm_object_cow::update_offsets(size_t off)
+{
+	int st = vm_object::update_offsets(off);
+
+	if(st == 0)
+		parent_off += off;
+
+	return st;
+}
+
+vm_object *vm_object::create_cow_clone()
+{
+	return new vm_object_cow(this, 0, nr_pages);
+}
+
 inline bool is_included(size_t lower, size_t upper, size_t x)
 {
 	if(x >= lower && x < upper)
@@ -111,8 +368,6 @@ void vm_object::purge_pages(size_t lower_bound, size_t upper_bound,
 {
 	scoped_spinlock l(&lock);
 
-	rb_itor it{&page_list, nullptr};
-
 	bool should_free = flags & PURGE_SHOULD_FREE;
 	bool exclusive = flags & PURGE_EXCLUDE;
 
@@ -123,17 +378,14 @@ void vm_object::purge_pages(size_t lower_bound, size_t upper_bound,
 	if(exclusive)
 		compare_function = is_excluded;
 
-	bool node_valid = rb_itor_first(&it);
+	unsigned long index;
+	struct page *p;
 
-	while(node_valid)
+	radix_tree_for_each(&page_index, index, p)
 	{
-		struct page *p = (struct page *) *rb_itor_datum(&it);
-
 		if(compare_function(lower_bound, upper_bound, p->off))
 		{
-			rb_itor_remove(&it);
-
-			node_valid = rb_itor_search_ge(&it, (const void *) p->off);
+			radix_tree_delete(&page_index, index);
 
 			p->next_un.next_virtual_region = nullptr;
 
@@ -146,10 +398,6 @@ void vm_object::purge_pages(size_t lower_bound, size_t upper_bound,
 			if(second)
 				second->add_page(p->off, p);
 		}
-		else
-		{
-			node_valid = rb_itor_next(&it);
-		}
 	}
 }
 
@@ -163,21 +411,67 @@ int vm_object::resize(size_t new_size)
 	return 0;
 }
 
-void vm_object::update_offsets(size_t off)
+/* Everything below off has been purged by now. The pages get indexed in a
+ * new tree, so that running out of memory for its nodes leaves us as we
+ * were; the old nodes are freed, which is fine as nothing looks pages up
+ * locklessly in objects that get offsets changed. */
+int vm_object::update_offsets(size_t off)
 {
 	scoped_spinlock l(&lock);
 
-	rb_itor it{&page_list, nullptr};
-
-	bool node_valid = rb_itor_first(&it);
+	struct radix_tree moved{};
+	unsigned long index;
+	struct page *page;
+	unsigned long shift = off >> PAGE_SHIFT;
 
-	while(node_valid)
+	radix_tree_for_each(&page_index, index, page)
 	{
-		auto page = (struct page *) *rb_itor_datum(&it);
+		if(radix_tree_insert(&moved, index - shift, page) < 0)
+		{
+			radix_tree_destroy(&moved, nullptr);
+			return -ENOMEM;
+		}
+	}
+
+	radix_tree_for_each(&page_index, index, page)
 		page->off -= off;
 
-		node_valid = rb_itor_next(&it);
+	radix_tree_destroy(&page_index, nullptr);
+	page_index = moved;
+
+	return 0;
+}
+
+/* Moves the pages src has at off and above over to us, off bytes lower.
+ * Either every page moves or, if we run out of memory, none does. */
+int vm_object::take_pages(vm_object *src, size_t off)
+{
+	scoped_spinlock l(&src->lock);
+	scoped_spinlock l2(&lock);
+
+	unsigned long first = off >> PAGE_SHIFT;
+	unsigned long index;
+	struct page *page;
+
+	for(index = first; (page = (struct page *) radix_tree_next(&src->page_index, &index));
+	    index++)
+	{
+		if(radix_tree_insert(&page_index, index - first, page) < 0)
+		{
+			/* Everything we hold is still src's */
+			radix_tree_destroy(&page_index, nullptr);
+			return -ENOMEM;
+		}
+	}
+
+	for(index = first; (page = (struct page *) radix_tree_next(&src->page_index, &index));
+	    index++)
+	{
+		radix_tree_delete(&src->page_index, index);
+		page->off -= off;
 	}
+
+	return 0;
 }
 
 vm_object *vm_object::split(size_t split_point, size_t hole_size)
@@ -194,9 +488,17 @@ vm_object *vm_object::split(size_t split_point, size_t hole_size)
 
 	auto max = hole_size + split_point;
 
+	/* second_vmo has no pages yet, so this can't fail; it only moves its
+	 * view of a cow parent */
+	second_vmo->update_offsets(max);
+
+	if(second_vmo->take_pages(this, max) < 0)
+	{
+		second_vmo->unref();
+		return nullptr;
+	}
+
 	purge_pages(split_point, max, PURGE_SHOULD_FREE);
-	purge_pages(max, nr_pages << PAGE_SHIFT, 0, second_vmo);
-	second_vmo->update_offsets(split_point + hole_size);
 
 	nr_pages -= hole_size_pgs + second_vmo->nr_pages;
 
@@ -207,13 +509,11 @@ void vm_object::sanity_check()
 {
 	scoped_spinlock l(&lock);
 
-	rb_itor it{&page_list, nullptr};
+	unsigned long index;
+	struct page *p;
 
-	bool node_valid = rb_itor_first(&it);
-
-	while(node_valid)
+	radix_tree_for_each(&page_index, index, p)
 	{
-		auto p = (struct page *) *rb_itor_datum(&it);
 		if(p->off > (nr_pages) << PAGE_SHIFT)
 		{
 			printf("Bad vmobject: p->off > nr_pages << PAGE_SHIFT.\n");
@@ -231,16 +531,21 @@ void vm_object::sanity_check()
 		}
 
 		printf("Page: %p\n", p->paddr);
-
-		node_valid = rb_itor_next(&it);
 	}
 }
 
-void vm_object::truncate_beginning_and_resize(size_t off)
+/* On failure, [0, off) has still been purged but nothing else changed */
+int vm_object::truncate_beginning_and_resize(size_t off)
 {
 	purge_pages(0, off, PURGE_SHOULD_FREE);
-	update_offsets(off);
+
+	int st = update_offsets(off);
+	if(st < 0)
+		return st;
+
 	nr_pages -= (off >> PAGE_SHIFT);
+
+	return 0;
 }
 
 bool vm_object_mmio::init(unsigned long phys)
@@ -272,18 +577,20 @@ int vm_object_mmio::commit(size_t offset)
 	return -1;
 }
 
-void vm_object::destroy_tree(void (*func)(void *, void *))
+void vm_object::destroy_tree(void (*func)(void *))
 {
-	rb_tree_free(&page_list, func);
+	radix_tree_destroy(&page_index, func);
 }
 
 vm_object::~vm_object()
 {
+	/* Specializations get rid of the pages; the nodes are left */
+	radix_tree_destroy(&page_index, nullptr);
 }
 
 vm_object_phys::~vm_object_phys()
 {
-	destroy_tree([](void *key, void *data)
+	destroy_tree([](void *data)
 	{
 		free_page((struct page *) data);
 	});
@@ -370,33 +677,360 @@ size_t vm_object::read(size_t offset, void *dst, size_t size)
 	while(size != 0)
 	{
 		size_t misalignment = offset & (PAGE_SIZE - 1);
+		bool shared;
 
-		auto page = get_may_commit_unlocked(offset - misalignment);
+		/* Reading doesn't need a private copy */
+		auto page = get_readonly(offset - misalignment, shared);
 		if(!page)
 		{
+			page = get_may_commit_unlocked(offset - misalignment);
+			if(!page)
+			{
+				lock.Unlock();
+				return been_read ? been_read : -1;
+			}
+
+			page_ref(page);
 			lock.Unlock();
-			return been_read ? been_read : -1;
 		}
 
 		size_t to_read = PAGE_SIZE - misalignment < size ? PAGE_SIZE - misalignment : size;
 		unsigned long paddr = (unsigned long) page->paddr + misalignment;
 		memcpy(d, phys_to_virt(paddr), to_read);
+		free_page(page);
 
 		been_read += to_read;
 		d += to_read;
 		offset += to_read;
 		size -= to_read;
-		lock.Unlock();
 	}
 
 	return been_read;
 }
 
-cbn_status_t sys_cbn_vmo_create(size_t size, cbn_handle_t *out)
+struct page *vm_object::get_page_ref(size_t offset, bool write)
+{
+	if(!write)
+	{
+		bool shared;
+
+		/* Reading doesn't need a private copy */
+		auto page = get_readonly(offset, shared);
+		if(page)
+			return page;
+	}
+
+	auto page = get_may_commit_unlocked(offset);
+	if(!page)
+		return nullptr;
+
+	page_ref(page);
+	lock.Unlock();
+
+	return page;
+}
+
+/* User memory is only ever touched with the lock dropped, as the buffer may
+ * well be a mapping of this same object */
+int vm_object::read_user(size_t offset, void *ubuf, size_t size)
+{
+	uint8_t *u = (uint8_t *) ubuf;
+
+	while(size != 0)
+	{
+		size_t misalignment = offset & (PAGE_SIZE - 1);
+		size_t to_read = PAGE_SIZE - misalignment < size ? PAGE_SIZE - misalignment : size;
+
+		auto page = get_page_ref(offset - misalignment, false);
+		if(!page)
+			return -ENOMEM;
+
+		unsigned long paddr = (unsigned long) page->paddr + misalignment;
+		cbn_status_t st = copy_to_user(u, phys_to_virt(paddr), to_read);
+		free_page(page);
+
+		if(st < 0)
+			return -EFAULT;
+
+		u += to_read;
+		offset += to_read;
+		size -= to_read;
+	}
+
+	return 0;
+}
+
+int vm_object::write_user(size_t offset, const void *ubuf, size_t size)
+{
+	const uint8_t *u = (const uint8_t *) ubuf;
+
+	while(size != 0)
+	{
+		size_t misalignment = offset & (PAGE_SIZE - 1);
+		size_t to_write = PAGE_SIZE - misalignment < size ? PAGE_SIZE - misalignment : size;
+
+		auto page = get_page_ref(offset - misalignment, true);
+		if(!page)
+			return -ENOMEM;
+
+		unsigned long paddr = (unsigned long) page->paddr + misalignment;
+		cbn_status_t st = copy_from_user(phys_to_virt(paddr), u, to_write);
+		free_page(page);
+
+		if(st < 0)
+			return -EFAULT;
+
+		u += to_write;
+		offset += to_write;
+		size -= to_write;
+	}
+
+	return 0;
+}
+
+void vm_object::add_mapping(struct vm_region *region)
+{
+	scoped_spinlock l(&lock);
+
+	region->vmo_prev = nullptr;
+	region->vmo_next = mappings;
+
+	if(mappings)
+		mappings->vmo_prev = region;
+	mappings = region;
+}
+
+void vm_object::remove_mapping(struct vm_region *region)
+{
+	scoped_spinlock l(&lock);
+
+	/* Not on the list */
+	if(!region->vmo_prev && mappings != region)
+		return;
+
+	if(region->vmo_prev)
+		region->vmo_prev->vmo_next = region->vmo_next;
+	else
+		mappings = region->vmo_next;
+
+	if(region->vmo_next)
+		region->vmo_next->vmo_prev = region->vmo_prev;
+
+	region->vmo_prev = region->vmo_next = nullptr;
+}
+
+bool vm_object::mapped_only_by(struct vm_region *region)
+{
+	scoped_spinlock l(&lock);
+
+	return mappings == region && !region->vmo_next && !nr_clones &&
+	       __refcount.load(mem_order::relaxed) == 1;
+}
+
+bool vm_object::is_mapped_by(struct vm_region *region)
+{
+	scoped_spinlock l(&lock);
+
+	for(struct vm_region *r = mappings; r; r = r->vmo_next)
+	{
+		if(r == region)
+			return true;
+	}
+
+	return false;
+}
+
+struct vm_mapping_snapshot
+{
+	struct address_space *as;
+	struct vm_region *region;
+};
+
+/* Zaps the part of [offset, offset + size) that region maps, if region still
+ * maps us by the time we hold its address space's lock */
+void vm_object::unmap_range_from(struct address_space *as, struct vm_region *region,
+				 size_t offset, size_t size)
+{
+	scoped_rw_spinlock<scoped_rwlock_write> guard{&as->lock};
+
+	if(!is_mapped_by(region))
+		return;
+
+	size_t start = offset > region->off ? offset : region->off;
+	size_t end = offset + size;
+
+	if(end > region->off + region->size)
+		end = region->off + region->size;
+
+	if(start >= end)
+		return;
+
+	unmap_page_range(as, (void *) (region->start + start - region->off), end - start);
+}
+
+int vm_object::decommit(size_t offset, size_t size)
+{
+	assert(((offset | size) & (PAGE_SIZE - 1)) == 0);
+
+	struct vm_mapping_snapshot *maps = nullptr;
+	size_t max_maps = 0;
+	size_t nr_maps;
+
+	/* The snapshot can't be allocated under the lock, so size it first and
+	 * try again if more mappings showed up in the meantime */
+	while(true)
+	{
+		lock.Lock();
+
+		if(__atomic_load_n(&nr_clones, __ATOMIC_RELAXED))
+		{
+			lock.Unlock();
+			delete[] maps;
+			return -EBUSY;
+		}
+
+		nr_maps = 0;
+		for(struct vm_region *r = mappings; r; r = r->vmo_next)
+			nr_maps++;
+
+		if(nr_maps <= max_maps)
+			break;
+
+		lock.Unlock();
+
+		delete[] maps;
+		max_maps = nr_maps;
+
+		if(!(maps = new vm_mapping_snapshot[max_maps]))
+			return -ENOMEM;
+	}
+
+	size_t i = 0;
+	for(struct vm_region *r = mappings; r; r = r->vmo_next, i++)
+		maps[i] = {r->as, r};
+
+	/* Take the pages out first, so faults from now on commit new ones
+	 * instead of mapping the old ones again */
+	struct page *freed = nullptr;
+	unsigned long index = offset >> PAGE_SHIFT;
+	unsigned long end = (offset + size) >> PAGE_SHIFT;
+	struct page *p;
+
+	while((p = (struct page *) radix_tree_next(&page_index, &index)) && index < end)
+	{
+		radix_tree_delete(&page_index, index);
+		p->next_un.next_allocation = freed;
+		freed = p;
+		index++;
+	}
+
+	lock.Unlock();
+
+	if(freed)
+	{
+		for(i = 0; i < nr_maps; i++)
+			unmap_range_from(maps[i].as, maps[i].region, offset, size);
+	}
+
+	delete[] maps;
+
+	while(freed)
+	{
+		struct page *next = freed->next_un.next_allocation;
+
+		freed->next_un.next_allocation = nullptr;
+		free_page(freed);
+		freed = next;
+	}
+
+	return 0;
+}
+
+int vm_object::zero(size_t offset, size_t size)
+{
+	while(size != 0)
+	{
+		size_t misalignment = offset & (PAGE_SIZE - 1);
+		size_t to_zero = PAGE_SIZE - misalignment < size ? PAGE_SIZE - misalignment : size;
+		bool shared;
+
+		auto page = get_readonly(offset - misalignment, shared);
+
+		/* Offsets that aren't committed and have nothing to look through
+		 * to already read as zeroes */
+		if(page && page != vm_zero_page)
+		{
+			if(shared)
+			{
+				/* Someone else's page, we need our own copy */
+				free_page(page);
+
+				if(!(page = get_page_ref(offset - misalignment, true)))
+					return -ENOMEM;
+			}
+
+			unsigned long paddr = (unsigned long) page->paddr + misalignment;
+			memset(phys_to_virt(paddr), 0, to_zero);
+		}
+
+		if(page)
+			free_page(page);
+
+		offset += to_zero;
+		size -= to_zero;
+	}
+
+	return 0;
+}
+
+int vm_object::set_size(size_t size)
+{
+	size_t align = huge_pages() ? VM_HUGE_PAGE_SIZE : PAGE_SIZE;
+
+	size = (size + align - 1) & ~(align - 1);
+
+	size_t old_size = get_size();
+
+	if(size < old_size && __atomic_load_n(&nr_clones, __ATOMIC_RELAXED))
+		return -EBUSY;
+
+	/* Shrink first, so that nothing past the new end gets faulted in
+	 * while we're decommitting it */
+	{
+		scoped_spinlock l(&lock);
+		nr_pages = size >> PAGE_SHIFT;
+	}
+
+	if(size < old_size)
+		return decommit(size, old_size - size);
+
+	return 0;
+}
+
+#define VMO_CREATE_VALID_FLAGS		(VMO_CREATE_HUGE_PAGES)
+
+cbn_status_t sys_cbn_vmo_create(size_t size, cbn_handle_t *out, unsigned long flags)
 {
 	auto& handle_table = get_current_process()->get_handle_table();
 
-	auto vmo = new vm_object_phys{true, size_to_pages(size), nullptr};
+	if(flags & ~VMO_CREATE_VALID_FLAGS)
+		return CBN_STATUS_INVALID_ARGUMENT;
+
+	vm_object_phys *vmo;
+
+	if(flags & VMO_CREATE_HUGE_PAGES)
+	{
+		size = (size + VM_HUGE_PAGE_SIZE - 1) & ~(VM_HUGE_PAGE_SIZE - 1);
+		vmo = new vm_object_huge{true, size_to_pages(size), nullptr};
+	}
+	else
+	{
+		/* Not anonymous: the vmo can be committed through the handle, or
+		 * a fault in another mapping, while mappings of the zero page
+		 * still sit in the rest, and those would read zeroes forever */
+		vmo = new vm_object_phys{true, size_to_pages(size), nullptr};
+	}
+
 	if(!vmo)
 		return CBN_STATUS_OUT_OF_MEMORY;
 	
@@ -419,3 +1053,130 @@ cbn_status_t sys_cbn_vmo_create(size_t size, cbn_handle_t *out)
 
 	return CBN_STATUS_OK;
 }
+
+cbn_status_t sys_cbn_vmo_clone(cbn_handle_t vmo_handle, cbn_handle_t *out)
+{
+	auto& handle_table = get_current_process()->get_handle_table();
+
+	auto h = get_handle_from_handle_id(vmo_handle, handle::vmo_object_type);
+	if(!h)
+		return CBN_STATUS_INVALID_HANDLE;
+
+	vm_object *vmo = static_cast<vm_object *>(h->get_object());
+
+	auto clone = vmo->create_cow_clone();
+	if(!clone)
+		return CBN_STATUS_OUT_OF_MEMORY;
+
+	handle *new_handle = new handle{clone, handle::vmo_object_type, get_current_process()};
+	if(!new_handle)
+	{
+		clone->unref();
+		return CBN_STATUS_OUT_OF_MEMORY;
+	}
+
+	auto handle_id = handle_table.allocate_handle(new_handle);
+	if(handle_id == CBN_INVALID_HANDLE)
+	{
+		delete new_handle;
+		return CBN_STATUS_OUT_OF_MEMORY;
+	}
+
+	if(copy_to_user(out, &handle_id, sizeof(handle_id)) < 0)
+		return CBN_STATUS_SEGFAULT;
+
+	return CBN_STATUS_OK;
+}
+
+/* Checks that [off, off + len) doesn't go past the end of the vmo */
+static inline bool vmo_range_is_valid(vm_object *vmo, size_t off, size_t len)
+{
+	return off + len >= off && off + len <= vmo->get_size();
+}
+
+static inline cbn_status_t vmo_errno_to_status(int st)
+{
+	switch(st)
+	{
+		case 0:
+			return CBN_STATUS_OK;
+		case -EFAULT:
+			return CBN_STATUS_SEGFAULT;
+		/* The vmo is being looked through by clones */
+		case -EBUSY:
+			return CBN_STATUS_INVALID_ARGUMENT;
+		default:
+			return CBN_STATUS_OUT_OF_MEMORY;
+	}
+}
+
+cbn_status_t sys_cbn_vmo_read(cbn_handle_t vmo_handle, void *buf, size_t off, size_t len)
+{
+	auto h = get_handle_from_handle_id(vmo_handle, handle::vmo_object_type);
+	if(!h)
+		return CBN_STATUS_INVALID_HANDLE;
+
+	vm_object *vmo = static_cast<vm_object *>(h->get_object());
+
+	if(!vmo_range_is_valid(vmo, off, len))
+		return CBN_STATUS_INVALID_ARGUMENT;
+
+	return vmo_errno_to_status(vmo->read_user(off, buf, len));
+}
+
+cbn_status_t sys_cbn_vmo_write(cbn_handle_t vmo_handle, const void *buf, size_t off, size_t len)
+{
+	auto h = get_handle_from_handle_id(vmo_handle, handle::vmo_object_type);
+	if(!h)
+		return CBN_STATUS_INVALID_HANDLE;
+
+	vm_object *vmo = static_cast<vm_object *>(h->get_object());
+
+	if(!vmo_range_is_valid(vmo, off, len))
+		return CBN_STATUS_INVALID_ARGUMENT;
+
+	return vmo_errno_to_status(vmo->write_user(off, buf, len));
+}
+
+cbn_status_t sys_cbn_vmo_op(cbn_handle_t vmo_handle, unsigned long op, size_t off, size_t len)
+{
+	auto h = get_handle_from_handle_id(vmo_handle, handle::vmo_object_type);
+	if(!h)
+		return CBN_STATUS_INVALID_HANDLE;
+
+	vm_object *vmo = static_cast<vm_object *>(h->get_object());
+
+	if(!vmo_range_is_valid(vmo, off, len))
+		return CBN_STATUS_INVALID_ARGUMENT;
+
+	switch(op)
+	{
+		case VMO_OP_COMMIT:
+			if((off | len) & (PAGE_SIZE - 1))
+				return CBN_STATUS_INVALID_ARGUMENT;
+			return vmo->populate(off, len) < 0 ? CBN_STATUS_OUT_OF_MEMORY : CBN_STATUS_OK;
+		case VMO_OP_DECOMMIT:
+			if((off | len) & (PAGE_SIZE - 1))
+				return CBN_STATUS_INVALID_ARGUMENT;
+			return vmo_errno_to_status(vmo->decommit(off, len));
+		case VMO_OP_ZERO:
+			return vmo_errno_to_status(vmo->zero(off, len));
+		default:
+			return CBN_STATUS_INVALID_ARGUMENT;
+	}
+}
+
+cbn_status_t sys_cbn_vmo_set_size(cbn_handle_t vmo_handle, size_t size)
+{
+	auto h = get_handle_from_handle_id(vmo_handle, handle::vmo_object_type);
+	if(!h)
+		return CBN_STATUS_INVALID_HANDLE;
+
+	vm_object *vmo = static_cast<vm_object *>(h->get_object());
+
+	/* Keep the rounding up from overflowing */
+	if(size > SIZE_MAX - VM_HUGE_PAGE_SIZE)
+		return CBN_STATUS_INVALID_ARGUMENT;
+
+	return vmo_errno_to_status(vmo->set_size(size));
+}
@@ -58,9 +58,14 @@ cbn_status_t cbn_readv(cbn_handle_t handle, const struct iovec *iovs, int veccnt
 	return syscall(SYS_cbn_readv, handle, iovs, veccnt, res);
 }
 
-cbn_status_t cbn_vmo_create(size_t size, cbn_handle_t *out)
+cbn_status_t cbn_vmo_create(size_t size, cbn_handle_t *out, unsigned long flags)
 {
-	return syscall(SYS_cbn_vmo_create, size, out);
+	return syscall(SYS_cbn_vmo_create, size, out, flags);
+}
+
+cbn_status_t cbn_vmo_clone(cbn_handle_t vmo_handle, cbn_handle_t *out)
+{
+	return syscall(SYS_cbn_vmo_clone, vmo_handle, out);
 }
 
 cbn_status_t cbn_mmap(cbn_handle_t process_handle, cbn_handle_t vmo_handle, void *hint,
@@ -73,4 +78,34 @@ cbn_status_t cbn_mmap(cbn_handle_t process_handle, cbn_handle_t vmo_handle, void
 	/* We need this struct because of the argument limit */
 
 	return syscall(SYS_cbn_mmap, process_handle, vmo_handle, hint, &args, prot, result);
-}
\ No newline at end of file
+}
+
+cbn_status_t cbn_vmo_read(cbn_handle_t vmo_handle, void *buf, size_t off, size_t len)
+{
+	return syscall(SYS_cbn_vmo_read, vmo_handle, buf, off, len);
+}
+
+cbn_status_t cbn_vmo_write(cbn_handle_t vmo_handle, const void *buf, size_t off, size_t len)
+{
+	return syscall(SYS_cbn_vmo_write, vmo_handle, buf, off, len);
+}
+
+cbn_status_t cbn_vmo_op(cbn_handle_t vmo_handle, unsigned long op, size_t off, size_t len)
+{
+	return syscall(SYS_cbn_vmo_op, vmo_handle, op, off, len);
+}
+
+cbn_status_t cbn_vmo_set_size(cbn_handle_t vmo_handle, size_t size)
+{
+	return syscall(SYS_cbn_vmo_set_size, vmo_handle, size);
+}
+
+cbn_status_t cbn_unmap(cbn_handle_t process_handle, void *ptr, size_t length)
+{
+	return syscall(SYS_cbn_unmap, process_handle, ptr, length);
+}
+
+cbn_status_t cbn_protect(cbn_handle_t process_handle, void *ptr, size_t length, long prot)
+{
+	return syscall(SYS_cbn_protect, process_handle, ptr, length, prot);
+}